@@ -0,0 +1,25 @@
+# dispatch benchmark: arithmetic, memory and call heavy loop that never halts
+LDI, 1, #0
+.outer
+LDI, 2, #0
+.inner
+ADDI, 1, 3
+LD, 3, 1
+ANDI, 3, 255
+XOR, 4, 3
+MULI, 4, 5
+STA, 4, scratch
+LDA, 5, scratch
+PUSH, 5
+JSRA, leaf
+POP, 6
+ADDI, 2, 1
+CMPI, 2, 1000
+BNE, inner
+JMPA, outer
+.leaf
+SUB, 5, 1
+OR, 7, 5
+RET
+.scratch
+DATAL, 0
@@ -0,0 +1,729 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pc32.h"
+#include "video.h"
+
+#define MAX(a, b) ((a)>(b)? (a) : (b))
+#define MIN(a, b) ((a)<(b)? (a) : (b))
+
+// The windowed front end hands the guest raylib key codes, so scripted input
+// does the same: letters are upper case and Enter is 257.
+#define KEY_ENTER 257
+
+// Cycle of a key typed whenever the program waits for input rather than at
+// a set time.
+#define ON_WAIT UINT64_MAX
+
+typedef struct {
+    uint64_t cycle;
+    int key;
+} ScriptedKey;
+
+// Keys to type into a run, in order.
+typedef struct {
+    ScriptedKey *keys;
+    int count;
+    int capacity;
+    int next;
+} KeyScript;
+
+typedef struct {
+    char *binary;
+    long long maxCycles;
+    KeyScript script;
+
+    const char *state;
+    uint64_t cycles;
+    uint32_t pc;
+    uint32_t sp;
+    uint32_t reg[16];
+    bool flags[4];
+    uint64_t textHash;
+} Job;
+
+struct Batch;
+
+// Each worker owns a range of job indices. It takes jobs from the front of
+// its own range and, once that is empty, steals the back half of another
+// worker's range.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+    int index;
+    struct Batch *batch;
+} Worker;
+
+typedef struct Batch {
+    Job *jobs;
+    int jobCount;
+    Worker *workers;
+    int workerCount;
+    uint32_t memorySize;
+} Batch;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs the program flat out and reports the achieved guest clock.
+void bench(PC32 *vm, long long totalCycles) {
+#ifdef PC32_THREADED_DISPATCH
+    const char *dispatch = "threaded";
+#else
+    const char *dispatch = "switch";
+#endif
+
+    reset(vm);
+    vm->running = true;
+
+    long long cycles = 0;
+    double start = now();
+
+    while (vm->running && cycles < totalCycles) {
+        cycles += run(vm, 1000000);
+    }
+
+    double elapsed = now() - start;
+
+    printf("%s dispatch: %lld cycles in %.3f s, %.2f MHz, %.2f MIPS\n", dispatch, cycles, elapsed,
+        cycles / elapsed / 1e6, vm->instructionCount / elapsed / 1e6);
+}
+
+// Times long loads and stores over a block of RAM, once on aligned addresses
+// and once on addresses one byte off, checking the loads against the bytes.
+void benchMemory(PC32 *vm) {
+    const uint32_t base = 0x10000;
+    const uint32_t span = 0x10000;
+    const int passes = 2000;
+
+    reset(vm);
+
+    for (uint32_t offset = 0; offset < 2; offset++) {
+        const char *pattern = offset == 0 ? "aligned" : "unaligned";
+
+        double start = now();
+
+        for (int pass = 0; pass < passes; pass++) {
+            for (uint32_t address = base + offset; address < base + span; address += 4) {
+                writeLong(vm, address, address + pass);
+            }
+        }
+
+        double writeTime = now() - start;
+
+        uint32_t sum = 0;
+        start = now();
+
+        for (int pass = 0; pass < passes; pass++) {
+            for (uint32_t address = base + offset; address < base + span; address += 4) {
+                sum += readLong(vm, address);
+            }
+        }
+
+        double readTime = now() - start;
+
+        for (uint32_t address = base + offset; address < base + span; address += 4) {
+            uint32_t bytes = (vm->memory[address] << 24) | (vm->memory[address + 1] << 16) | (vm->memory[address + 2] << 8) | vm->memory[address + 3];
+
+            if (readLong(vm, address) != bytes || bytes != address + passes - 1) {
+                printf("%s long access mismatch at 0x%08X\n", pattern, address);
+                return;
+            }
+        }
+
+        double accesses = (double)passes * (span / 4);
+
+        printf("%s long access: %.1f M writes/s, %.1f M reads/s (checksum %08X)\n",
+            pattern, accesses / writeTime / 1e6, accesses / readTime / 1e6, sum);
+    }
+}
+
+// Hands timed keys to the machine, which presses them at their cycles, and
+// types a key without a cycle whenever the program waits in INT 0 or HLT
+// once the keys before it are in. A key that does not fit is tried again
+// later.
+void typeKeys(PC32 *vm, KeyScript *script) {
+    while (script->next < script->count) {
+        ScriptedKey *next = &script->keys[script->next];
+
+        if (next->cycle != ON_WAIT) {
+            if (!scheduleKey(vm, next->cycle, next->key)) {
+                break;
+            }
+
+            script->next++;
+            continue;
+        }
+
+        bool waiting = (!vm->running && vm->interrupt == INT_KEYBOARD) || vm->halted;
+
+        if (waiting && vm->timedHead == vm->timedTail && pressKey(vm, next->key)) {
+            script->next++;
+        }
+
+        break;
+    }
+}
+
+// Times every palette expansion kernel the host can run on random indices,
+// at the guest resolution and at 4K, after checking that its output matches
+// the scalar kernel byte for byte.
+void benchPalette() {
+    const int sizes[][2] = { { SCREEN_WIDTH, SCREEN_HEIGHT }, { 3840, 2160 } };
+    PaletteKernel kernels[MAX_PALETTE_KERNELS];
+    int kernelCount = paletteKernels(kernels);
+    uint32_t palette[256];
+    uint32_t random = RANDOM_SEED;
+
+    for (int i = 0; i < 256; i++) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        palette[i] = random;
+    }
+
+    for (int size = 0; size < 2; size++) {
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+        int count = width * height;
+        uint8_t *in = malloc(count);
+        uint32_t *expected = malloc(count * sizeof(uint32_t));
+        uint32_t *out = malloc(count * sizeof(uint32_t));
+
+        for (int i = 0; i < count; i++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            in[i] = random;
+        }
+
+        kernels[0].expand(expected, in, palette, count);
+
+        for (int k = 0; k < kernelCount; k++) {
+            // Odd lengths and offsets exercise the scalar tails too.
+            memset(out, 0, count * sizeof(uint32_t));
+            kernels[k].expand(out + 1, in + 1, palette, count - 3);
+
+            if (out[0] != 0 || memcmp(out + 1, expected + 1, (count - 3) * sizeof(uint32_t)) != 0 ||
+                out[count - 2] != 0) {
+                printf("%s palette expansion mismatch at %dx%d\n", kernels[k].name, width, height);
+                continue;
+            }
+
+            int frames = 0;
+            double start = now();
+            double elapsed;
+
+            do {
+                kernels[k].expand(out, in, palette, count);
+                frames++;
+            } while ((elapsed = now() - start) < 0.25);
+
+            printf("%s palette expansion at %dx%d: %.2f GB/s, %.0f frames/s\n", kernels[k].name, width, height,
+                (double)frames * count * sizeof(uint32_t) / elapsed / 1e9, frames / elapsed);
+        }
+
+        free(in);
+        free(expected);
+        free(out);
+    }
+}
+
+// Whether the CPU sleeps in HLT with only the keyboard IRQ left to wake it
+// and no keys queued or still to come, which would otherwise idle forever.
+bool waitsForKeys(PC32 *vm, KeyScript *script) {
+    bool vblank = vm->interruptsEnabled && (vm->irqMask & (1 << IRQ_VBLANK));
+
+    return vm->halted && vm->timerPeriod == 0 && !vblank && vm->keyHead == vm->keyTail &&
+        vm->timedHead == vm->timedTail && (!script || script->next == script->count);
+}
+
+// Runs until the program halts, waits for a key that the script does not
+// have or uses up maxCycles (0 for no limit). Returns the number of cycles
+// run.
+long long runProgram(PC32 *vm, long long maxCycles, KeyScript *script) {
+    long long cycles = 0;
+
+    vm->running = true;
+
+    while (maxCycles == 0 || cycles < maxCycles) {
+        if (script) {
+            typeKeys(vm, script);
+        }
+
+        if (!vm->running || waitsForKeys(vm, script)) {
+            break;
+        }
+
+        // Run a frame at a time like the window does, which is as often as
+        // an untimed key gets a chance to be typed and a halt with nothing
+        // but the keyboard left to wake it is noticed. Timed keys arrive
+        // through EVENT_KEY.
+        long long budget = maxCycles == 0 ? MAX(vm->cyclesPerFrame, 1) : MIN(MAX(vm->cyclesPerFrame, 1), maxCycles - cycles);
+
+        cycles += run(vm, budget);
+    }
+
+    return cycles;
+}
+
+const char *stateName(PC32 *vm) {
+    if (vm->faulted) {
+        return "FAULT";
+    } else if (vm->running) {
+        return "RUNNING";
+    } else if (vm->interrupt == INT_KEYBOARD) {
+        return "WAITING";
+    }
+
+    return "HALTED";
+}
+
+void dumpRegisters(PC32 *vm) {
+    printf("PC %08X\n", vm->pc);
+    printf("SP %08X\n", vm->sp);
+
+    for (int i = 0; i < 16; i++) {
+        printf("R%-2d %08X%s", i, vm->reg[i], i % 4 == 3 ? "\n" : "  ");
+    }
+
+    printf("FLAGS Z%d C%d O%d N%d\n", zeroFlag(vm), carryFlag(vm), overflowFlag(vm), negativeFlag(vm));
+    printf("CYCLES %llu\n", (unsigned long long)vm->cycleCount);
+    printf("STATE %s\n", stateName(vm));
+}
+
+void dumpMemory(PC32 *vm, uint32_t address, uint32_t length) {
+    for (uint32_t i = address; i < address + length && i < vm->memorySize; i += 16) {
+        printf("%08X:", i);
+
+        for (uint32_t j = i; j < i + 16 && j < address + length && j < vm->memorySize; j++) {
+            printf(" %02X", vm->memory[j]);
+        }
+
+        printf("\n");
+    }
+}
+
+// Prints text mode VRAM one row per line, with trailing blanks trimmed and
+// anything unprintable shown as a space.
+void dumpText(PC32 *vm) {
+    uint8_t *screen = vm->memory + VRAM(vm);
+
+    for (int y = 0; y < TEXT_ROWS; y++) {
+        char line[TEXT_COLUMNS + 1];
+        int length = 0;
+
+        for (int x = 0; x < TEXT_COLUMNS; x++) {
+            uint8_t c = screen[y * TEXT_COLUMNS + x];
+
+            line[x] = c >= 0x20 && c < 0x7F ? c : ' ';
+
+            if (line[x] != ' ') {
+                length = x + 1;
+            }
+        }
+
+        line[length] = 0;
+        printf("%s\n", line);
+    }
+}
+
+// FNV-1a over the character cells of text mode VRAM.
+uint64_t hashText(PC32 *vm) {
+    uint8_t *screen = vm->memory + VRAM(vm);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int i = 0; i < TEXT_COLUMNS * TEXT_ROWS; i++) {
+        hash = (hash ^ screen[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// Adds the rest of a line to the script as keys typed at cycle. \n is Enter
+// and \\ is a backslash; everything else is typed as is.
+void parseKeys(const char *text, uint64_t cycle, KeyScript *script) {
+    for (const char *c = text; *c && *c != '\n' && *c != '\r'; c++) {
+        int key = *c;
+
+        if (key == '\\' && c[1] == 'n') {
+            key = KEY_ENTER;
+            c++;
+        } else if (key == '\\' && c[1] == '\\') {
+            c++;
+        } else if (key >= 'a' && key <= 'z') {
+            key -= 'a' - 'A';
+        }
+
+        if (script->count == script->capacity) {
+            script->capacity = script->capacity ? script->capacity * 2 : 64;
+            script->keys = realloc(script->keys, script->capacity * sizeof(ScriptedKey));
+        }
+
+        script->keys[script->count++] = (ScriptedKey){ .cycle = cycle, .key = key };
+    }
+}
+
+const char *skipBlanks(const char *text) {
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+
+    return text;
+}
+
+// Each line of a key script is "<cycle> <keys>", typing the keys at once as
+// soon as the guest has run that many cycles, or "* <keys>" to type them one
+// by one whenever it waits for input. Lines are taken in order and blank
+// lines and lines starting with # are skipped.
+bool loadScript(const char *path, KeyScript *script) {
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        return false;
+    }
+
+    char line[4096];
+
+    while (fgets(line, sizeof(line), file)) {
+        const char *keys = skipBlanks(line);
+        unsigned long long cycle = ON_WAIT;
+        int consumed = 0;
+
+        if (keys[0] == '#') {
+            continue;
+        } else if (keys[0] == '*') {
+            keys++;
+        } else if (sscanf(keys, "%llu%n", &cycle, &consumed) == 1) {
+            keys += consumed;
+        } else {
+            continue;
+        }
+
+        parseKeys(skipBlanks(keys), cycle, script);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+// Each line of a manifest is "<binary> <cycle limit> [keyboard input]",
+// where the input is typed whenever the program waits for it, or is @ and
+// the path of a key script. Blank lines and lines starting with # are
+// skipped.
+int loadManifest(const char *path, Job **jobs) {
+    FILE *file = fopen(path, "r");
+
+    if (!file) {
+        return -1;
+    }
+
+    char line[4096];
+    int count = 0;
+    int capacity = 0;
+
+    *jobs = NULL;
+
+    while (fgets(line, sizeof(line), file)) {
+        char binary[1024];
+        long long maxCycles;
+        int consumed;
+
+        if (line[0] == '#' || sscanf(line, "%1023s %lld%n", binary, &maxCycles, &consumed) != 2) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            *jobs = realloc(*jobs, capacity * sizeof(Job));
+        }
+
+        const char *keys = skipBlanks(line + consumed);
+
+        Job *job = &(*jobs)[count++];
+        memset(job, 0, sizeof(Job));
+
+        job->binary = strdup(binary);
+        job->maxCycles = maxCycles;
+
+        if (keys[0] == '@') {
+            char script[1024];
+
+            if (sscanf(keys + 1, "%1023s", script) != 1 || !loadScript(script, &job->script)) {
+                fprintf(stderr, "Failed to open key script for %s\n", binary);
+            }
+        } else {
+            parseKeys(keys, ON_WAIT, &job->script);
+        }
+    }
+
+    fclose(file);
+
+    return count;
+}
+
+// Gives the machine a clean start, so a result only depends on the job.
+void runJob(PC32 *vm, Job *job) {
+    FILE *file = fopen(job->binary, "rb");
+
+    if (!file) {
+        job->state = "MISSING";
+        return;
+    }
+
+    fclose(file);
+
+    vm->program = job->binary;
+    vm->random = RANDOM_SEED;
+
+    reset(vm);
+
+    job->script.next = 0;
+    runProgram(vm, job->maxCycles, &job->script);
+
+    job->state = stateName(vm);
+    job->cycles = vm->cycleCount;
+    job->pc = vm->pc;
+    job->sp = vm->sp;
+    memcpy(job->reg, vm->reg, sizeof(job->reg));
+    job->flags[0] = zeroFlag(vm);
+    job->flags[1] = carryFlag(vm);
+    job->flags[2] = overflowFlag(vm);
+    job->flags[3] = negativeFlag(vm);
+    job->textHash = hashText(vm);
+}
+
+// Returns the next job for worker, stealing if its own range is empty, or -1
+// once every range is empty. Jobs never create jobs, so that is the end.
+int takeJob(Worker *worker) {
+    Batch *batch = worker->batch;
+    int job = -1;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->head < worker->tail) {
+        job = worker->head++;
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    for (int i = 1; job < 0 && i < batch->workerCount; i++) {
+        Worker *victim = &batch->workers[(worker->index + i) % batch->workerCount];
+        int head = 0;
+        int tail = 0;
+
+        pthread_mutex_lock(&victim->lock);
+
+        if (victim->head < victim->tail) {
+            tail = victim->tail;
+            victim->tail -= (victim->tail - victim->head + 1) / 2;
+            head = victim->tail;
+        }
+
+        pthread_mutex_unlock(&victim->lock);
+
+        if (head < tail) {
+            pthread_mutex_lock(&worker->lock);
+            worker->head = head + 1;
+            worker->tail = tail;
+            pthread_mutex_unlock(&worker->lock);
+
+            job = head;
+        }
+    }
+
+    return job;
+}
+
+void *workerMain(void *arg) {
+    Worker *worker = arg;
+    PC32 *vm = createMachine(worker->batch->memorySize);
+
+    if (!vm) {
+        fprintf(stderr, "Failed to reserve guest memory\n");
+        exit(1);
+    }
+
+    for (int job = takeJob(worker); job >= 0; job = takeJob(worker)) {
+        runJob(vm, &worker->batch->jobs[job]);
+    }
+
+    destroyMachine(vm);
+
+    return NULL;
+}
+
+void printResult(Job *job) {
+    printf("%s state=%s cycles=%llu pc=%08X sp=%08X flags=%d%d%d%d", job->binary, job->state,
+        (unsigned long long)job->cycles, job->pc, job->sp, job->flags[0], job->flags[1], job->flags[2], job->flags[3]);
+
+    for (int i = 0; i < 16; i++) {
+        printf(" r%d=%08X", i, job->reg[i]);
+    }
+
+    printf(" text=%016llX\n", (unsigned long long)job->textHash);
+}
+
+// Runs every job in the manifest on workerCount threads, each with its own
+// machine, and prints one result line per job in manifest order.
+int runBatch(const char *manifest, int workerCount, uint32_t memorySize) {
+    Batch batch = { 0 };
+
+    batch.jobCount = loadManifest(manifest, &batch.jobs);
+
+    if (batch.jobCount < 0) {
+        printf("Failed to open %s\n", manifest);
+        return 1;
+    }
+
+    batch.workerCount = workerCount;
+    batch.workers = calloc(workerCount, sizeof(Worker));
+    batch.memorySize = memorySize;
+
+    for (int i = 0; i < workerCount; i++) {
+        Worker *worker = &batch.workers[i];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->head = (long long)batch.jobCount * i / workerCount;
+        worker->tail = (long long)batch.jobCount * (i + 1) / workerCount;
+        worker->index = i;
+        worker->batch = &batch;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_create(&batch.workers[i].thread, NULL, workerMain, &batch.workers[i]);
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+        pthread_mutex_destroy(&batch.workers[i].lock);
+    }
+
+    for (int i = 0; i < batch.jobCount; i++) {
+        printResult(&batch.jobs[i]);
+
+        free(batch.jobs[i].binary);
+        free(batch.jobs[i].script.keys);
+    }
+
+    free(batch.jobs);
+    free(batch.workers);
+
+    return 0;
+}
+
+void usage() {
+    printf("Usage: pc32-headless [--ram <1-16 MB>] [--cycles <n>] [--keys <script>] [--dump <address> <length>] [--text] [--bench [cycles]] [program]\n");
+    printf("       pc32-headless [--ram <1-16 MB>] [--jobs <n>] --batch <manifest>\n");
+}
+
+int main(int argc, char **argv) {
+    int ram = MIN_MEMORY >> 20;
+    long long maxCycles = 0;
+    long long benchCycles = 0;
+    bool dump = false;
+    uint32_t dumpAddress = 0;
+    uint32_t dumpLength = 0;
+    bool text = false;
+    const char *program = "out.bin";
+    const char *manifest = NULL;
+    KeyScript script = { 0 };
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ram") == 0 && i + 1 < argc) {
+            ram = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            maxCycles = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            if (!loadScript(argv[++i], &script)) {
+                printf("Failed to open %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 2 < argc) {
+            dump = true;
+            dumpAddress = strtoul(argv[++i], NULL, 0);
+            dumpLength = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--text") == 0) {
+            text = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            benchCycles = i + 1 < argc && argv[i + 1][0] != '-' ? atoll(argv[++i]) : 400000000LL;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            program = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (ram < MIN_MEMORY >> 20 || ram > MAX_MEMORY >> 20 || maxCycles < 0 || jobs < 1) {
+        usage();
+        return 1;
+    }
+
+    if (manifest) {
+        return runBatch(manifest, jobs, ram << 20);
+    }
+
+    FILE *file = fopen(program, "rb");
+
+    if (!file) {
+        printf("Failed to open %s\n", program);
+        return 1;
+    }
+
+    fclose(file);
+
+    PC32 *vm = createMachine(ram << 20);
+
+    if (!vm) {
+        printf("Failed to reserve guest memory\n");
+        return 1;
+    }
+
+    vm->program = program;
+
+    if (benchCycles > 0) {
+        bench(vm, benchCycles);
+        benchMemory(vm);
+        benchPalette();
+        destroyMachine(vm);
+        return 0;
+    }
+
+    reset(vm);
+
+    runProgram(vm, maxCycles, &script);
+
+    dumpRegisters(vm);
+
+    if (dump) {
+        dumpMemory(vm, dumpAddress, dumpLength);
+    }
+
+    if (text) {
+        dumpText(vm);
+    }
+
+    destroyMachine(vm);
+    free(script.keys);
+
+    return 0;
+}
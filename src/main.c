@@ -1,6 +1,11 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "raylib.h"
 #include "raymath.h"
@@ -8,109 +13,140 @@
 #define RAYLIB_NUKLEAR_IMPLEMENTATION
 #include "raylib-nuklear.h"
 
+#include "pc32.h"
+#include "video.h"
+
 #define MAX(a, b) ((a)>(b)? (a) : (b))
 #define MIN(a, b) ((a)<(b)? (a) : (b))
 
-#define MEMORY (1 << 20)
 #define MAX_SPEED 100.0f
-#define REFRESH_RATE 60
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-#define VRAM MEMORY - (SCREEN_WIDTH * SCREEN_HEIGHT)
-
+#define MEMORY_VIEW_SIZE 1008
+#define COMMAND_QUEUE_SIZE 64
+#define FRAME_FRESH 4
+#define TURBO_CHUNK 100000
+#define MAX_CATCH_UP 0.25
+#define MAX_FRAME_SKIP 5
+#define METER_INTERVAL 0.5
+#define BLINK_FRAMES 16
+
+// The UI talks to the emulation thread only through commands.
 typedef enum {
-    VM_TEXT = 0,
-    VM_BITMAP,
-} VideoMode;
-
-typedef enum {
-    INT_KEYBOARD = 0,
-    INT_VIDEOMODE,
-    INT_SETCURPOS,
-    INT_GETCURPOS,
-    INT_WRITECHAR,
-    INT_GETPIXEL,
-    INT_SETPIXEL,
-    INT_WRITESTR,
-    INT_WRITENUM,
-} Interrupt;
-
-enum {
-    OP_NOP = 0,
-    OP_HALT, // 1
-    OP_ADD,
-    OP_ADDI,
-    OP_AND,
-    OP_ANDI,
-    OP_BEQ,
-    OP_BGE,
-    OP_BGEU,
-    OP_BGT,
-    OP_BGTU,
-    OP_BLE,
-    OP_BLEU,
-    OP_BLT,
-    OP_BLTU,
-    OP_BNE,
-    OP_CMP,
-    OP_CMPI,
-    OP_DIV,
-    OP_DIVI,
-    OP_DIVU,
-    OP_JMP,
-    OP_JMPA,
-    OP_JSR,
-    OP_JSRA,
-    OP_LD,
-    OP_LDA,
-    OP_LDI,
-    OP_LDR,
-    OP_MUL,
-    OP_MULI,
-    OP_MULU,
-    OP_NEG,
-    OP_NOT,
-    OP_OR,
-    OP_ORI,
-    OP_POP,
-    OP_PUSH,
-    OP_RET,
-    OP_STB,
-    OP_STA,
-    OP_SUB,
-    OP_SUBI,
-    OP_XOR,
-    OP_XORI,
-    OP_RND,
-    OP_INT,
-    OP_LDBI,
-    OP_LDBA,
-};
-
-uint8_t memory[MEMORY];
-uint32_t reg[16];
-uint32_t pc;
-uint32_t sp;
-
-bool zero = false;
-bool carry = false;
-bool overflow = false;
-bool negative = false;
-
-bool running = false;
-float speed = 1.0f;
-int cyclesPerFrame;
+    CMD_RUN = 0,
+    CMD_STOP,
+    CMD_STEP,
+    CMD_RESET,
+    CMD_SPEED,
+    CMD_KEY,
+    CMD_TURBO,
+    CMD_VIEW,
+    CMD_QUIT,
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    float speed;
+    int key;
+    bool turbo;
+    uint32_t address;
+} Command;
+
+// Everything the render thread needs from one emulated frame.
+typedef struct {
+    uint32_t pc;
+    uint32_t sp;
+    uint32_t reg[16];
+    bool zero;
+    bool carry;
+    bool overflow;
+    bool negative;
+    bool running;
+    unsigned commandsHandled;
+    int cyclesPerFrame;
+    uint64_t cycleCount;
+    double mhz;
+    double mips;
+    double hostCpi;
+    VideoMode videoMode;
+    bool blink;
+    uint32_t viewAddress;
+    uint8_t view[MEMORY_VIEW_SIZE];
+    uint8_t vram[VRAM_SIZE];
+    // VRAM lines changed since the frame published before this one.
+    uint32_t dirtyLines[DIRTY_WORDS];
+    unsigned sequence;
+} Frame;
+
+// Single producer, single consumer ring written by the render thread. The
+// lock and condition are only for waking an idle emulation thread.
+Command commands[COMMAND_QUEUE_SIZE];
+atomic_uint commandHead = 0;
+atomic_uint commandTail = 0;
+pthread_mutex_t commandLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commandSent = PTHREAD_COND_INITIALIZER;
+
+// Triple buffer: the emulation thread owns backFrame, the render thread owns
+// frontFrame and readyFrame holds the latest finished frame, with FRAME_FRESH
+// set until the render thread takes it.
+Frame frames[3];
+int backFrame = 0;
+atomic_int readyFrame = 1;
+int frontFrame = 2;
+
+// VRAM lines each frame buffer is behind the machine by, so publishing only
+// copies those.
+uint32_t staleLines[3][DIRTY_WORDS];
+unsigned published = 0;
+
+uint32_t viewAddress = 0;
+
+// Achieved guest speed over the last METER_INTERVAL, and the host cycles
+// spent running the guest per guest instruction.
+typedef struct {
+    double time;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t hostCycles;
+    double mhz;
+    double mips;
+    double hostCpi;
+} Meter;
+
+Meter meter = { 0 };
 
 int startAddress = 0;
 
-VideoMode videoMode = VM_TEXT;
-
-Interrupt interrupt = -1;
-
 Font dosFont;
 
-int cursorX = 0;
-int cursorY = 0;
+// Both modes are drawn from one texture, updated from the lines of pixels
+// that changed. Bitmap mode fills them by expanding VRAM through the palette
+// and text mode by copying cell images for the cells that differ from
+// shownText.
+Texture2D screen;
+uint32_t pixels[VRAM_SIZE];
+TextRenderer text;
+uint16_t shownText[TEXT_CELLS];
+bool textShown = false;
+
+// The screen is only redrawn where VRAM changed since the frame last drawn,
+// unless frames were dropped in between or the video mode changed.
+bool drawnAny = false;
+unsigned drawnSequence;
+VideoMode drawnMode;
+bool drawnBlinkOff = false;
+
+// Redraw statistics for the debugger, over the last METER_INTERVAL.
+typedef struct {
+    double time;
+    int frames;
+    int redrawn;
+    int lines;
+    int lastLines;
+    int lastCells;
+    double redrawnShare;
+    double averageLines;
+} DrawStats;
+
+DrawStats drawStats = { 0 };
 
 Color palette[256] = {
     (Color){0, 0, 0, 255}, // Black
@@ -131,627 +167,479 @@ Color palette[256] = {
     (Color){255, 255, 255, 255}, // White
 };
 
-uint8_t readByte(uint32_t address) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
+bool sendCommand(Command command) {
+    unsigned tail = atomic_load_explicit(&commandTail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&commandHead, memory_order_acquire) == COMMAND_QUEUE_SIZE) {
+        return false;
     }
 
-    return memory[address];
-}
+    commands[tail % COMMAND_QUEUE_SIZE] = command;
+    atomic_store_explicit(&commandTail, tail + 1, memory_order_release);
 
-uint16_t readWord(uint32_t address) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
-    }
+    pthread_mutex_lock(&commandLock);
+    pthread_cond_signal(&commandSent);
+    pthread_mutex_unlock(&commandLock);
 
-    return (memory[address] << 8) | memory[address + 1];
+    return true;
 }
 
-uint32_t readLong(uint32_t address) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
+bool receiveCommand(Command *command) {
+    unsigned head = atomic_load_explicit(&commandHead, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&commandTail, memory_order_acquire)) {
+        return false;
     }
 
-    return (memory[address] << 24) | (memory[address + 1] << 16) | (memory[address + 2] << 8) | memory[address + 3];
+    *command = commands[head % COMMAND_QUEUE_SIZE];
+    atomic_store_explicit(&commandHead, head + 1, memory_order_release);
+
+    return true;
 }
 
-void writeByte(uint32_t address, uint8_t value) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
+// Blocks until the render thread sends something.
+void waitForCommand() {
+    pthread_mutex_lock(&commandLock);
+
+    while (atomic_load(&commandHead) == atomic_load(&commandTail)) {
+        pthread_cond_wait(&commandSent, &commandLock);
     }
 
-    memory[address] = value;
+    pthread_mutex_unlock(&commandLock);
 }
 
-void writeWord(uint32_t address, uint16_t value) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
+void publishFrame(PC32 *vm) {
+    Frame *frame = &frames[backFrame];
+    uint32_t address = viewAddress;
+
+    frame->pc = vm->pc;
+    frame->sp = vm->sp;
+    memcpy(frame->reg, vm->reg, sizeof(frame->reg));
+    frame->zero = zeroFlag(vm);
+    frame->carry = carryFlag(vm);
+    frame->overflow = overflowFlag(vm);
+    frame->negative = negativeFlag(vm);
+    frame->running = vm->running;
+    frame->commandsHandled = atomic_load(&commandHead);
+    frame->cyclesPerFrame = vm->cyclesPerFrame;
+    frame->cycleCount = vm->cycleCount;
+    frame->mhz = meter.mhz;
+    frame->mips = meter.mips;
+    frame->hostCpi = meter.hostCpi;
+    frame->videoMode = vm->videoMode;
+    frame->blink = vm->blink;
+
+    // The view may run past the end of RAM, which reads as zero.
+    memset(frame->view, 0, sizeof(frame->view));
+
+    if (address < vm->memorySize) {
+        memcpy(frame->view, vm->memory + address, MIN(MEMORY_VIEW_SIZE, vm->memorySize - address));
     }
 
-    memory[address] = value >> 8;
-    memory[address + 1] = value & 0xFF;
-}
+    frame->viewAddress = address;
+
+    for (int i = 0; i < DIRTY_WORDS; i++) {
+        frame->dirtyLines[i] = vm->dirtyLines[i];
+
+        for (int j = 0; j < 3; j++) {
+            staleLines[j][i] |= vm->dirtyLines[i];
+        }
 
-void writeLong(uint32_t address, uint32_t value) {
-    if (address > MEMORY) {
-        printf("Invalid memory address: 0x%08X\n", address);
-        exit(1);
+        vm->dirtyLines[i] = 0;
     }
 
-    memory[address] = value >> 24;
-    memory[address + 1] = (value >> 16) & 0xFF;
-    memory[address + 2] = (value >> 8) & 0xFF;
-    memory[address + 3] = value & 0xFF;
+    for (int line = 0; line < SCREEN_HEIGHT; line++) {
+        if (staleLines[backFrame][line / 32] & (1u << (line % 32))) {
+            memcpy(frame->vram + line * SCREEN_WIDTH, vm->memory + VRAM(vm) + line * SCREEN_WIDTH, SCREEN_WIDTH);
+        }
+    }
+
+    memset(staleLines[backFrame], 0, sizeof(staleLines[backFrame]));
+
+    frame->sequence = ++published;
+
+    backFrame = atomic_exchange(&readyFrame, backFrame | FRAME_FRESH) & ~FRAME_FRESH;
 }
 
-void push(uint32_t value) {
-    sp -= 4;
-    writeLong(sp, value);
+// Returns the latest published frame, or the previous one if nothing new
+// has been finished since.
+Frame *acquireFrame() {
+    if (atomic_load(&readyFrame) & FRAME_FRESH) {
+        frontFrame = atomic_exchange(&readyFrame, frontFrame) & ~FRAME_FRESH;
+    }
+
+    return &frames[frontFrame];
 }
 
-uint32_t pop() {
-    uint32_t value = readLong(sp);
-    sp += 4;
-    return value;
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void setSpeed(float spd) {
-    speed = spd;
-    cyclesPerFrame = (int)(speed * 1000000 / REFRESH_RATE);
+// Host timestamp counter, or 0 on hosts without one.
+static inline uint64_t hostCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
 }
 
-void reset() {
-    pc = 0;
-    sp = VRAM - 4;
+void updateMeter(PC32 *vm, uint64_t busy) {
+    double time = now();
 
-    for (int i = 0; i < 16; i++) {
-        reg[i] = 0;
-    }
+    meter.hostCycles += busy;
 
-    for (int i = 0; i < MEMORY; i++) {
-        memory[i] = 0;
+    if (time - meter.time < METER_INTERVAL) {
+        return;
     }
 
-    setSpeed(speed);
+    uint64_t instructions = vm->instructionCount - meter.instructions;
 
-    zero = false;
-    carry = false;
-    overflow = false;
-    negative = false;
+    meter.mhz = (vm->cycleCount - meter.cycles) / (time - meter.time) / 1e6;
+    meter.mips = instructions / (time - meter.time) / 1e6;
+    meter.hostCpi = instructions ? (double)meter.hostCycles / instructions : 0;
 
-    running = false;
+    meter.time = time;
+    meter.cycles = vm->cycleCount;
+    meter.instructions = vm->instructionCount;
+    meter.hostCycles = 0;
+}
 
-    videoMode = VM_TEXT;
+void resetMeter(PC32 *vm) {
+    meter = (Meter){ .time = now(), .cycles = vm->cycleCount, .instructions = vm->instructionCount };
+}
 
-    interrupt = -1;
+// Runs the machine a frame at a time at REFRESH_RATE, independently of how
+// fast the window is drawn. Each frame runs the cycles that the real time
+// since the last one is worth at the set speed, so a late frame is made up
+// by the next, up to MAX_CATCH_UP seconds. While the host is more than a
+// frame behind, up to MAX_FRAME_SKIP frames in a row are not published.
+// While the machine is not running the thread blocks until a command comes.
+// In turbo mode each frame runs the guest for as long as the frame lasts.
+void *emulate(void *arg) {
+    PC32 *vm = arg;
+    double next = now();
+    double last = next;
+    double owed = 0;
+    int skipped = 0;
+    bool turbo = false;
+
+    resetMeter(vm);
+
+    while (true) {
+        Command command;
+
+        while (receiveCommand(&command)) {
+            switch (command.type) {
+                case CMD_RUN:
+                    vm->running = true;
+                    break;
+                case CMD_STOP:
+                    vm->running = false;
+                    break;
+                case CMD_STEP:
+                    step(vm);
+                    break;
+                case CMD_RESET:
+                    reset(vm);
+                    resetMeter(vm);
+                    break;
+                case CMD_SPEED:
+                    setSpeed(vm, command.speed);
+                    break;
+                case CMD_KEY:
+                    pressKey(vm, command.key);
+                    break;
+                case CMD_TURBO:
+                    turbo = command.turbo;
+                    break;
+                case CMD_VIEW:
+                    viewAddress = command.address;
+                    break;
+                case CMD_QUIT:
+                    return NULL;
+            }
+        }
 
-    cursorX = 0;
-    cursorY = 0;
+        next += 1.0 / REFRESH_RATE;
 
-    startAddress = 0;
+        double time = now();
 
-    FILE *file = fopen("out.bin", "rb");
+        owed = MIN(owed + (time - last) * vm->speed * 1e6, MAX_CATCH_UP * vm->speed * 1e6);
+        last = time;
 
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        long size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        fread(memory, 1, size, file);
-        fclose(file);
-    }
-}
+        uint64_t start = hostCycles();
 
-void handleInterrupts() {
-    switch (interrupt) {
-        case INT_KEYBOARD:
-            int key = GetKeyPressed();
+        if (turbo) {
+            do {
+                run(vm, TURBO_CHUNK);
 
-            if (key == 0) {
-                running = false;
-            } else {
-                reg[0] = key;
-                running = true;
-                interrupt = -1;
+                handleInterrupts(vm);
+            } while (vm->running && now() < next);
+        } else {
+            // A halted CPU idles only up to what is owed, so owed goes
+            // negative only when the last block runs past the budget, and
+            // the next frame pays back the overshoot.
+            if (owed >= 1) {
+                owed -= run(vm, owed);
             }
 
-            break;
-        case INT_VIDEOMODE:
-            videoMode = reg[0];
-            interrupt = -1;
-            break;
-        case INT_SETCURPOS:
-            cursorX = reg[0];
-            cursorY = reg[1];
-            interrupt = -1;
-            break;
-        case INT_GETCURPOS:
-            reg[0] = cursorX;
-            reg[1] = cursorY;
-            interrupt = -1;
-            break;
-        case INT_WRITECHAR:
-            writeByte(VRAM + cursorX + cursorY * 80, reg[0]);
-            cursorX++;
-            interrupt = -1;
-            break;
-        case INT_SETPIXEL:
-            writeByte(VRAM + reg[0] + reg[1] * 640, reg[2]);
-            interrupt = -1;
-            break;
-        case INT_GETPIXEL:
-            reg[0] = readByte(VRAM + reg[1] + reg[2] * 640);
-            interrupt = -1;
-            break;
-        case INT_WRITESTR:
-            for (int i = 0; i < reg[1]; i++) {
-                writeByte(VRAM + cursorX + cursorY * 80, readByte(reg[0] + i));
-
-                if (cursorX == 80) {
-                    cursorX = 0;
-                    cursorY++;
-                } else {
-                    cursorX++;
-                }
+            handleInterrupts(vm);
+        }
 
-                if (VRAM + cursorX + cursorY * 80 >= VRAM + SCREEN_WIDTH / 8 * SCREEN_HEIGHT / 8) {
-                    cursorX = 0;
-                    cursorY = 0;
-                }
-            }
+        // Nothing is owed for time spent stopped.
+        if (turbo || !vm->running) {
+            owed = 0;
+        }
 
-            interrupt = -1;
-            break;
-        case INT_WRITENUM:
-            char str[16];
-            sprintf(str, "%d", reg[0]);
+        updateMeter(vm, hostCycles() - start);
 
-            for (int i = 0; i < strlen(str); i++) {
-                writeByte(VRAM + cursorX + cursorY * 80, str[i]);
+        if (!vm->running) {
+            resetMeter(vm);
+        }
 
-                if (cursorX == 80) {
-                    cursorX = 0;
-                    cursorY++;
-                } else {
-                    cursorX++;
-                }
+        double late = now() - next;
 
-                if (VRAM + cursorX + cursorY * 80 >= VRAM + SCREEN_WIDTH / 8 * SCREEN_HEIGHT / 8) {
-                    cursorX = 0;
-                    cursorY = 0;
-                }
-            }
+        if (late > 1.0 / REFRESH_RATE && skipped < MAX_FRAME_SKIP && vm->running) {
+            skipped++;
+        } else {
+            publishFrame(vm);
+            skipped = 0;
+        }
 
-            interrupt = -1;
-            break;
+        // A halted, stopped or waiting machine has nothing to do until the
+        // UI sends a key or a command, so sleep until it does.
+        if (!vm->running) {
+            waitForCommand();
+            resetMeter(vm);
+            next = meter.time;
+            last = next;
+            continue;
+        }
+
+        if (late < 0) {
+            struct timespec ts = { (time_t)-late, (long)((-late - (time_t)-late) * 1e9) };
+            nanosleep(&ts, NULL);
+        } else if (late > MAX_CATCH_UP) {
+            next = now();
+        }
     }
 }
 
-int step() {
-    int cycles = 0;
+static inline bool lineDirty(const uint32_t *dirty, int line) {
+    return dirty[line / 32] & (1u << (line % 32));
+}
 
-    uint8_t opcode = readByte(pc);
-    pc++;
+// Whether any text cell on screen blinks, which keeps the screen changing.
+bool blinking(Frame *frame) {
+    if (frame->videoMode != VM_TEXT || !frame->blink) {
+        return false;
+    }
 
-    if (pc >= MEMORY) {
-        pc = 0;
+    for (int i = 0; i < TEXT_CELLS; i++) {
+        if (frame->vram[TEXT_CELLS + i] & ATTR_BLINK) {
+            return true;
+        }
     }
 
-    int r1, r2;
+    return false;
+}
 
-    switch (opcode) {
-    case OP_NOP:
-        cycles = 4;
-        break;
-    case OP_ADD:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] += reg[r2];
-        cycles = 4;
-        break;
-    case OP_ADDI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] += readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_AND:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] &= reg[r2];
-        cycles = 4;
-        break;
-    case OP_ANDI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] &= readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_BEQ:
-        if (zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
-        }
+// Works out which VRAM lines need redrawing for frame and returns how many.
+// When blinking cells change phase every line is a candidate, and the text
+// renderer only redraws the cells that look different.
+int findDirtyLines(Frame *frame, uint32_t *dirty, bool blinkOff) {
+    if (blinkOff != drawnBlinkOff) {
+        memset(dirty, 0xFF, DIRTY_WORDS * sizeof(uint32_t));
+    } else if (drawnAny && frame->sequence == drawnSequence) {
+        memset(dirty, 0, DIRTY_WORDS * sizeof(uint32_t));
+    } else if (!drawnAny || frame->sequence != drawnSequence + 1 || frame->videoMode != drawnMode) {
+        memset(dirty, 0xFF, DIRTY_WORDS * sizeof(uint32_t));
+    } else {
+        memcpy(dirty, frame->dirtyLines, DIRTY_WORDS * sizeof(uint32_t));
+    }
 
-        cycles = 4;
-        break;
-    case OP_BGE:
-        if (negative || zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
-        }
+    drawnAny = true;
+    drawnSequence = frame->sequence;
+    drawnMode = frame->videoMode;
+    drawnBlinkOff = blinkOff;
 
-        cycles = 4;
-        break;
-    case OP_BGEU:
-        if (carry || zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
-        }
+    int count = 0;
 
-        cycles = 4;
-        break;
-    case OP_BGT:
-        if (negative) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
-        }
+    for (int line = 0; line < SCREEN_HEIGHT; line++) {
+        count += lineDirty(dirty, line);
+    }
 
-        cycles = 4;
-        break;
-    case OP_BGTU:
-        if (negative) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
-        }
+    return count;
+}
 
-        cycles = 4;
-        break;
-    case OP_BLE:
-        if (!negative || zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
+static inline void setLine(uint32_t *lines, int line) {
+    lines[line / 32] |= 1u << (line % 32);
+}
+
+// Uploads each run of the given lines of pixels in one go and draws it over
+// the target.
+void showLines(const uint32_t *lines) {
+    for (int start = 0; start < SCREEN_HEIGHT; start++) {
+        if (!lineDirty(lines, start)) {
+            continue;
         }
 
-        cycles = 4;
-        break;
-    case OP_BLEU:
-        if (!negative || zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
+        int end = start;
+
+        while (end < SCREEN_HEIGHT && lineDirty(lines, end)) {
+            end++;
         }
 
-        cycles = 4;
-        break;
-    case OP_BLT:
-        if (negative) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
+        Rectangle run = { 0, start, SCREEN_WIDTH, end - start };
+
+        UpdateTextureRec(screen, run, pixels + start * SCREEN_WIDTH);
+
+        DrawRectangleRec(run, BLACK);
+        DrawTextureRec(screen, run, (Vector2){ 0, start }, WHITE);
+
+        start = end;
+    }
+}
+
+// Redraws the dirty lines of frame over what is already on the target and
+// returns the number of text cells drawn. Text cells are only drawn when
+// they differ from what the pixels already show.
+int draw(Frame *frame, const uint32_t *dirty, bool blinkOff) {
+    uint32_t changed[DIRTY_WORDS] = { 0 };
+    int cells = 0;
+
+    switch (frame->videoMode)
+    {
+    case VM_BITMAP:
+        for (int line = 0; line < SCREEN_HEIGHT; line++) {
+            if (lineDirty(dirty, line)) {
+                expandPalette(pixels + line * SCREEN_WIDTH, frame->vram + line * SCREEN_WIDTH,
+                    (const uint32_t *)palette, SCREEN_WIDTH);
+            }
         }
 
-        cycles = 4;
+        showLines(dirty);
+        textShown = false;
+
         break;
-    case OP_BLTU:
-        if (negative) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
+    case VM_TEXT:
+        for (int y = 0; y < TEXT_ROWS; y++) {
+            int cell = y * TEXT_COLUMNS;
+
+            if (!lineDirty(dirty, cell / SCREEN_WIDTH) && !lineDirty(dirty, (TEXT_CELLS + cell) / SCREEN_WIDTH)) {
+                continue;
+            }
+
+            int drawn = renderTextRow(&text, pixels + y * GLYPH_SIZE * SCREEN_WIDTH, SCREEN_WIDTH,
+                frame->vram + cell, frame->vram + TEXT_CELLS + cell, shownText + cell, TEXT_COLUMNS,
+                frame->blink, blinkOff, !textShown);
+
+            if (drawn > 0) {
+                for (int line = y * GLYPH_SIZE; line < (y + 1) * GLYPH_SIZE; line++) {
+                    setLine(changed, line);
+                }
+            }
+
+            cells += drawn;
         }
 
-        cycles = 4;
-        break;
-    case OP_BNE:
-        if (!zero) {
-            pc = readLong(pc);
-        } else {
-            pc += 4;
+        showLines(changed);
+        textShown = true;
+    }
+
+    return cells;
+}
+
+// Renders the coverage of every character of font into the glyph atlas,
+// the way DrawTextEx drew a cell holding it: 0, tab and newline draw
+// nothing and codes from 128 up, which are not valid UTF-8 on their own,
+// draw '?'.
+void buildGlyphs(Font font) {
+    memset(text.glyphs, 0, sizeof(text.glyphs));
+
+    for (int c = 0; c < 256; c++) {
+        if (c == 0 || c == '\t' || c == '\n') {
+            continue;
         }
 
-        cycles = 4;
-        break;
-    case OP_CMP:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        zero = reg[r1] == reg[r2];
-        carry = reg[r1] > reg[r2];
-        overflow = false;
-        negative = reg[r1] < reg[r2];
-        cycles = 4;
-        break;
-    case OP_CMPI:
-        r1 = readByte(pc);
-        pc++;
-        zero = reg[r1] == readLong(pc);
-        carry = reg[r1] > readLong(pc);
-        overflow = false;
-        negative = reg[r1] < readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_DIV:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] = (int)(reg[r1] / reg[r2]);
-        reg[0] = reg[r1] % reg[r2];
-        cycles = 4;
-        break;
-    case OP_DIVI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = (int)(reg[r1] / readLong(pc));
-        reg[0] = reg[r1] % readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_DIVU:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] = (int)(reg[r1] / reg[r2]);
-        reg[0] = reg[r1] % reg[r2];
-        cycles = 4;
-        break;
-    case OP_JMP:
-        r1 = readByte(pc);
-        pc++;
-        pc = readLong(reg[r1]);
-        cycles = 4;
-        break;
-    case OP_JMPA:
-        pc = readLong(pc);
-        cycles = 4;
-        break;
-    case OP_JSR:
-        r1 = readByte(pc);
-        pc++;
-        push(pc);
-        pc = readLong(reg[r1]);
-        cycles = 4;
-        break;
-    case OP_JSRA:
-        push(pc + 4);
-        pc = readLong(pc);
-        cycles = 4;
-        break;
-    case OP_LD:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] = reg[r2];
-        cycles = 4;
-        break;
-    case OP_LDA:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = readLong(readLong(pc));
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_LDBA:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = readByte(readLong(pc));
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_LDI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_LDBI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = readByte(pc);
-        pc++;
-        cycles = 4;
-        break;
-    case OP_LDR:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] = readLong(reg[r2]);
-        cycles = 4;
-        break;
-    case OP_MUL:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] *= reg[r2];
-        cycles = 4;
-        break;
-    case OP_MULI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] *= readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_MULU:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] *= reg[r2];
-        cycles = 4;
-        break;
-    case OP_NEG:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = -reg[r1];
-        cycles = 4;
-        break;
-    case OP_NOT:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = ~reg[r1];
-        cycles = 4;
-        break;
-    case OP_OR:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] |= reg[r2];
-        cycles = 4;
-        break;
-    case OP_ORI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] |= readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_POP:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] = pop();
-        cycles = 4;
-        break;
-    case OP_PUSH:
-        r1 = readByte(pc);
-        pc++;
-        push(reg[r1]);
-        cycles = 4;
-        break;
-    case OP_RET:
-        pc = pop();
-        cycles = 4;
-        break;
-    case OP_STB:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        writeByte(reg[r2], reg[r1]);
-        cycles = 4;
-        break;
-    case OP_STA:
-        r1 = readByte(pc);
-        pc++;
-        writeLong(readLong(pc), reg[r1]);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_SUB:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] -= reg[r2];
-        cycles = 4;
-        break;
-    case OP_SUBI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] -= readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_XOR:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] ^= reg[r2];
-        cycles = 4;
-        break;
-    case OP_XORI:
-        r1 = readByte(pc);
-        pc++;
-        reg[r1] ^= readLong(pc);
-        pc += 4;
-        cycles = 4;
-        break;
-    case OP_HALT:
-        running = false;
-        cycles = cyclesPerFrame;
-        break;
-    case OP_RND:
-        r1 = readByte(pc);
-        pc++;
-        r2 = readByte(pc);
-        pc++;
-        reg[r1] = GetRandomValue(0, r2);
-        cycles = 4;
-        break;
-    case OP_INT:
-        r1 = readByte(pc);
-        pc++;
+        GlyphInfo *glyph = &font.glyphs[GetGlyphIndex(font, c < 128 ? c : '?')];
 
-        interrupt = r1;
+        for (int y = 0; y < glyph->image.height; y++) {
+            for (int x = 0; x < glyph->image.width; x++) {
+                int cellX = glyph->offsetX + x;
+                int cellY = glyph->offsetY + y;
 
-        if (interrupt == INT_KEYBOARD) {
-            cycles = cyclesPerFrame;
-        } else {
-            cycles = 4;
+                if (cellX < 0 || cellX >= GLYPH_SIZE || cellY < 0 || cellY >= GLYPH_SIZE) {
+                    continue;
+                }
+
+                text.glyphs[c][cellY * GLYPH_SIZE + cellX] = GetImageColor(glyph->image, x, y).r;
+            }
         }
+    }
+}
 
-        break;
-    default:
-        printf("Unknown opcode: %02X\n", opcode);
+void updateDrawStats(int lines, int cells) {
+    double time = GetTime();
+
+    drawStats.frames++;
+    drawStats.redrawn += lines > 0;
+    drawStats.lines += lines;
+    drawStats.lastLines = lines;
+    drawStats.lastCells = cells;
+
+    if (time - drawStats.time < METER_INTERVAL) {
+        return;
     }
 
-    handleInterrupts();
+    drawStats.redrawnShare = (double)drawStats.redrawn / drawStats.frames;
+    drawStats.averageLines = (double)drawStats.lines / drawStats.frames;
 
-    return cycles;
+    drawStats.time = time;
+    drawStats.frames = 0;
+    drawStats.redrawn = 0;
+    drawStats.lines = 0;
 }
 
-void draw() {
-    switch (videoMode)
-    {
-    case VM_BITMAP:
-        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-            int x = i % SCREEN_WIDTH;
-            int y = i / SCREEN_WIDTH;
+uint8_t viewByte(Frame *frame, uint32_t address) {
+    uint32_t offset = address - frame->viewAddress;
+
+    return offset < MEMORY_VIEW_SIZE ? frame->view[offset] : 0;
+}
+
+void usage() {
+    printf("Usage: pc32 [--ram <1-16 MB>]\n");
+}
 
-            uint8_t color = readByte(VRAM + i);
+int main(int argc, char **argv) {
+    int ram = MIN_MEMORY >> 20;
 
-            DrawPixel(x, y, palette[color]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ram") == 0 && i + 1 < argc) {
+            ram = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
         }
+    }
 
-        break;
-    case VM_TEXT:
-        for (int i = 0; i < SCREEN_WIDTH / 8 * SCREEN_HEIGHT / 8; i++) {
-            int x = i % (SCREEN_WIDTH / 8);
-            int y = i / (SCREEN_WIDTH / 8);
+    if (ram < MIN_MEMORY >> 20 || ram > MAX_MEMORY >> 20) {
+        usage();
+        return 1;
+    }
 
-            uint8_t c = readByte(VRAM + i);
+    PC32 *vm = createMachine(ram << 20);
 
-            DrawTextEx(dosFont, TextFormat("%c", c), (Vector2){ x * 8, y * 8 }, dosFont.baseSize, 0, WHITE);
-        }
+    if (!vm) {
+        printf("Failed to reserve guest memory\n");
+        return 1;
     }
-}
 
-int main() {
+    vm->random = time(NULL);
+
     SetTraceLogLevel(LOG_NONE);
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "PC32");
@@ -763,14 +651,56 @@ int main() {
     RenderTexture2D target = LoadRenderTexture(SCREEN_WIDTH, SCREEN_HEIGHT);
     SetTextureFilter(target.texture, TEXTURE_FILTER_POINT);
 
+    screen = LoadTextureFromImage((Image){ .data = pixels, .width = SCREEN_WIDTH, .height = SCREEN_HEIGHT,
+        .mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 });
+    SetTextureFilter(screen, TEXTURE_FILTER_POINT);
+
     dosFont = LoadFontEx("assets/dos.ttf", 8, 0, 0);
 
+    buildGlyphs(dosFont);
+    setTextColors(&text, (const uint32_t *)palette);
+
     struct nk_context *ctx = InitNuklearEx(dosFont, 8);
 
-    reset();
+    reset(vm);
+
+    publishFrame(vm);
+
+    float speed = vm->speed;
+    float sentSpeed = speed;
+    nk_bool turbo = false;
+    int sentAddress = startAddress;
+    bool waiting = false;
+
+    pthread_t emulator;
+    pthread_create(&emulator, NULL, emulate, vm);
 
     while (!WindowShouldClose()) {
-        SetWindowTitle(TextFormat("PC32 - %d FPS - %.2f MHz", GetFPS(), speed));
+        Frame *frame = acquireFrame();
+
+        // Once the machine is idle and has handled every command, nothing
+        // but blinking text changes until the user does something, so
+        // without it let raylib sleep until the next input event instead of
+        // redrawing every frame.
+        bool blinks = blinking(frame);
+        bool blinkOff = blinks && (int)(GetTime() * REFRESH_RATE / BLINK_FRAMES) % 2;
+        bool idle = !frame->running && frame->commandsHandled == atomic_load(&commandTail) && !blinks;
+
+        if (idle != waiting) {
+            waiting = idle;
+
+            if (waiting) {
+                EnableEventWaiting();
+            } else {
+                DisableEventWaiting();
+            }
+        }
+
+        SetWindowTitle(TextFormat("PC32 - %d FPS - %.2f MHz", GetFPS(), turbo ? frame->mhz : speed));
+
+        for (int key = GetKeyPressed(); key != 0; key = GetKeyPressed()) {
+            sendCommand((Command){ .type = CMD_KEY, .key = key });
+        }
 
         UpdateNuklear(ctx);
 
@@ -782,16 +712,16 @@ int main() {
         virtualMouse.y = (mouse.y - (GetScreenHeight() - (SCREEN_HEIGHT*scale))*0.5f)/scale;
         virtualMouse = Vector2Clamp(virtualMouse, (Vector2){ 0, 0 }, (Vector2){ (float)SCREEN_WIDTH, (float)SCREEN_HEIGHT });
 
-        if (nk_begin(ctx, "CPU", nk_rect(100, 100, 250, 820),
+        if (nk_begin(ctx, "CPU", nk_rect(100, 100, 250, 940),
             NK_WINDOW_BORDER|NK_WINDOW_MOVABLE|NK_WINDOW_TITLE)) {
 
             nk_layout_row_dynamic(ctx, 20, 2);
 
             nk_label(ctx, "PC", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%08X", pc), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%08X", frame->pc), NK_TEXT_LEFT);
 
             nk_label(ctx, "SP", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%08X", sp), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%08X", frame->sp), NK_TEXT_LEFT);
 
             nk_label(ctx, "REGISTERS", NK_TEXT_LEFT);
 
@@ -799,7 +729,7 @@ int main() {
 
             for (int i = 0; i < 16; i++) {
                 nk_label(ctx, TextFormat("R %d", i), NK_TEXT_LEFT);
-                nk_label(ctx, TextFormat("%08X", reg[i]), NK_TEXT_LEFT);
+                nk_label(ctx, TextFormat("%08X", frame->reg[i]), NK_TEXT_LEFT);
             }
 
             nk_label(ctx, "FLAGS", NK_TEXT_LEFT);
@@ -807,16 +737,16 @@ int main() {
             nk_spacing(ctx, 1);
 
             nk_label(ctx, "ZERO", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%d", zero), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%d", frame->zero), NK_TEXT_LEFT);
 
             nk_label(ctx, "CARRY", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%d", carry), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%d", frame->carry), NK_TEXT_LEFT);
 
             nk_label(ctx, "OVERFLOW", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%d", overflow), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%d", frame->overflow), NK_TEXT_LEFT);
 
             nk_label(ctx, "NEGATIVE", NK_TEXT_LEFT);
-            nk_label(ctx, TextFormat("%d", negative), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%d", frame->negative), NK_TEXT_LEFT);
 
             nk_label(ctx, "SPEED", NK_TEXT_LEFT);
             nk_label(ctx, TextFormat("%.2f MHz", speed), NK_TEXT_LEFT);
@@ -825,32 +755,74 @@ int main() {
             nk_layout_row_dynamic(ctx, 30, 1);
 
             nk_slider_float(ctx, 0.0f, &speed, MAX_SPEED, 0.0001f);
-            setSpeed(speed);
+
+            if (speed != sentSpeed && sendCommand((Command){ .type = CMD_SPEED, .speed = speed })) {
+                sentSpeed = speed;
+            }
 
             nk_layout_row_dynamic(ctx, 30, 2);
 
             nk_label(ctx, "CPF", NK_TEXT_LEFT);
 
-            nk_label(ctx, TextFormat("%d", cyclesPerFrame), NK_TEXT_LEFT);
+            nk_label(ctx, TextFormat("%d", frame->cyclesPerFrame), NK_TEXT_LEFT);
+
+            nk_label(ctx, "CYCLES", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%llu", (unsigned long long)frame->cycleCount), NK_TEXT_LEFT);
+
+            nk_label(ctx, "MHZ", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%.2f", frame->mhz), NK_TEXT_LEFT);
+
+            nk_label(ctx, "MIPS", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%.2f", frame->mips), NK_TEXT_LEFT);
+
+            nk_label(ctx, "HOST CPI", NK_TEXT_LEFT);
+
+            nk_label(ctx, frame->hostCpi > 0 ? TextFormat("%.1f", frame->hostCpi) : "-", NK_TEXT_LEFT);
+
+            nk_label(ctx, "DIRTY LINES", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%d / %.1f avg", drawStats.lastLines, drawStats.averageLines), NK_TEXT_LEFT);
+
+            nk_label(ctx, "REDRAWN", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%.0f%% of frames", drawStats.redrawnShare * 100), NK_TEXT_LEFT);
+
+            nk_label(ctx, "TEXT CELLS", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%d", drawStats.lastCells), NK_TEXT_LEFT);
+
+            nk_label(ctx, "CELL CACHE", NK_TEXT_LEFT);
+
+            nk_label(ctx, TextFormat("%d misses", text.misses), NK_TEXT_LEFT);
+
+            nk_label(ctx, "TURBO", NK_TEXT_LEFT);
+
+            if (nk_checkbox_label(ctx, "", &turbo)) {
+                sendCommand((Command){ .type = CMD_TURBO, .turbo = turbo });
+            }
 
             nk_label(ctx, "CONTROLS", NK_TEXT_LEFT);
 
             nk_layout_row_dynamic(ctx, 30, 4);
 
             if (nk_button_label(ctx, "RESET")) {
-                reset();
+                sendCommand((Command){ .type = CMD_RESET });
+                startAddress = 0;
             }
 
             if (nk_button_label(ctx, "RUN")) {
-                running = true;
+                sendCommand((Command){ .type = CMD_RUN });
             }
 
             if (nk_button_label(ctx, "STOP")) {
-                running = false;
+                sendCommand((Command){ .type = CMD_STOP });
             }
 
             if (nk_button_label(ctx, "STEP")) {
-                step();
+                sendCommand((Command){ .type = CMD_STEP });
             }
         }
         nk_end(ctx);
@@ -860,14 +832,18 @@ int main() {
 
             nk_layout_row_dynamic(ctx, 30, 3);
 
-            nk_property_int(ctx, "Start Address", 0, &startAddress, MEMORY - 1000, 1, 1);
+            nk_property_int(ctx, "Start Address", 0, &startAddress, vm->memorySize - 1000, 1, 1);
+
+            if (startAddress != sentAddress && sendCommand((Command){ .type = CMD_VIEW, .address = startAddress })) {
+                sentAddress = startAddress;
+            }
 
             if (nk_button_label(ctx, "STACK")) {
-                startAddress = sp;
+                startAddress = frame->sp;
             }
 
             if (nk_button_label(ctx, "CODE")) {
-                startAddress = pc;
+                startAddress = frame->pc;
             }
 
             nk_layout_row_dynamic(ctx, 30, 1);
@@ -876,41 +852,40 @@ int main() {
 
             nk_spacing(ctx, 1);
 
+            // For a frame after the start address changes, the bytes shown
+            // are from the frame's older view and anything outside it is zero.
             for (int i = startAddress; i < startAddress + 1000; i+=16) {
                 nk_layout_row_dynamic(ctx, 30, 17);
 
                 nk_label(ctx, TextFormat("%08X:", i), NK_TEXT_LEFT);
 
                 for (int j = 0; j < 16; j++) {
-                    if (pc == i+j) {
-                        nk_label_colored(ctx, TextFormat("%02X", memory[i+j]), NK_TEXT_RIGHT, nk_rgb(255, 0, 0));
-                    } else if (sp == i+j) {
-                        nk_label_colored(ctx, TextFormat("%02X", memory[i+j]), NK_TEXT_RIGHT, nk_rgb(0, 255, 0));
+                    if (frame->pc == i+j) {
+                        nk_label_colored(ctx, TextFormat("%02X", viewByte(frame, i+j)), NK_TEXT_RIGHT, nk_rgb(255, 0, 0));
+                    } else if (frame->sp == i+j) {
+                        nk_label_colored(ctx, TextFormat("%02X", viewByte(frame, i+j)), NK_TEXT_RIGHT, nk_rgb(0, 255, 0));
                     } else {
-                        nk_label(ctx, TextFormat("%02X", memory[i+j]), NK_TEXT_RIGHT);
+                        nk_label(ctx, TextFormat("%02X", viewByte(frame, i+j)), NK_TEXT_RIGHT);
                     }
                 }
             }
         }
         nk_end(ctx);
 
-        if (running) {
-            int cycles = 0;
-
-            while (cycles < cyclesPerFrame) {
-                cycles += step();
-            }
-        }
+        uint32_t dirty[DIRTY_WORDS];
+        int dirtyCount = findDirtyLines(frame, dirty, blinkOff);
 
-        handleInterrupts();
+        int cells = 0;
 
-        BeginTextureMode(target);
+        if (dirtyCount > 0) {
+            BeginTextureMode(target);
 
-            ClearBackground(BLACK);
+                cells = draw(frame, dirty, blinkOff);
 
-            draw();
+            EndTextureMode();
+        }
 
-        EndTextureMode();
+        updateDrawStats(dirtyCount, cells);
 
         BeginDrawing();
 
@@ -925,13 +900,23 @@ int main() {
         EndDrawing();
     }
 
+    while (!sendCommand((Command){ .type = CMD_QUIT })) {
+        WaitTime(0.001);
+    }
+
+    pthread_join(emulator, NULL);
+
     UnloadNuklear(ctx);
 
     UnloadFont(dosFont);
 
+    UnloadTexture(screen);
+
     UnloadRenderTexture(target);
 
     CloseWindow();
 
+    destroyMachine(vm);
+
     return 0;
 }
@@ -0,0 +1,1504 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pc32.h"
+
+// Guest RAM sits at the start of a reservation covering every 32-bit address
+// plus a guard page, so any access outside RAM faults instead of needing a
+// bounds check.
+#define ADDRESS_SPACE ((size_t)1 << 32)
+#define GUARD_SIZE 4096
+
+// The guest is big-endian. Word and long accesses are a single, possibly
+// unaligned, host access plus a byte swap on little-endian hosts.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BIG_ENDIAN_16(x) (x)
+#define BIG_ENDIAN_32(x) (x)
+#else
+#define BIG_ENDIAN_16(x) __builtin_bswap16(x)
+#define BIG_ENDIAN_32(x) __builtin_bswap32(x)
+#endif
+
+#define NO_ADDRESS 0xFFFFFFFF
+
+enum {
+    OP_NOP = 0,
+    OP_HALT, // 1
+    OP_ADD,
+    OP_ADDI,
+    OP_AND,
+    OP_ANDI,
+    OP_BEQ,
+    OP_BGE,
+    OP_BGEU,
+    OP_BGT,
+    OP_BGTU,
+    OP_BLE,
+    OP_BLEU,
+    OP_BLT,
+    OP_BLTU,
+    OP_BNE,
+    OP_CMP,
+    OP_CMPI,
+    OP_DIV,
+    OP_DIVI,
+    OP_DIVU,
+    OP_JMP,
+    OP_JMPA,
+    OP_JSR,
+    OP_JSRA,
+    OP_LD,
+    OP_LDA,
+    OP_LDI,
+    OP_LDR,
+    OP_MUL,
+    OP_MULI,
+    OP_MULU,
+    OP_NEG,
+    OP_NOT,
+    OP_OR,
+    OP_ORI,
+    OP_POP,
+    OP_PUSH,
+    OP_RET,
+    OP_STB,
+    OP_STA,
+    OP_SUB,
+    OP_SUBI,
+    OP_XOR,
+    OP_XORI,
+    OP_RND,
+    OP_INT,
+    OP_LDBI,
+    OP_LDBA,
+    OP_RTI,
+};
+
+// Superinstructions formed when a block is translated. A compare followed by
+// a branch becomes one instruction testing the relation the branch would
+// see in the CMP flags; LDI followed by a non-blocking INT becomes another.
+enum {
+    OP_CMP_EQ = 0x80,
+    OP_CMP_NE,
+    OP_CMP_LT,
+    OP_CMP_LE,
+    OP_CMP_GE,
+    OP_CMPI_EQ,
+    OP_CMPI_NE,
+    OP_CMPI_LT,
+    OP_CMPI_LE,
+    OP_CMPI_GE,
+    OP_LDI_INT,
+};
+
+#define CMPI_FUSED_OFFSET (OP_CMPI_EQ - OP_CMP_EQ)
+
+// BGE is taken on negative or zero (a <= b), BGEU, BLE and BLEU on carry or
+// zero / not negative (a >= b), and the remaining branches on negative.
+static const uint8_t fusedCompares[256] = {
+    [OP_BEQ] = OP_CMP_EQ,
+    [OP_BNE] = OP_CMP_NE,
+    [OP_BGT] = OP_CMP_LT, [OP_BGTU] = OP_CMP_LT, [OP_BLT] = OP_CMP_LT, [OP_BLTU] = OP_CMP_LT,
+    [OP_BGE] = OP_CMP_LE,
+    [OP_BGEU] = OP_CMP_GE, [OP_BLE] = OP_CMP_GE, [OP_BLEU] = OP_CMP_GE,
+};
+
+typedef enum {
+    FMT_NONE = 0, // opcode
+    FMT_R, // opcode, r1
+    FMT_RR, // opcode, r1, r2
+    FMT_RB, // opcode, r1, imm8
+    FMT_RI, // opcode, r1, imm32
+    FMT_I, // opcode, imm32
+} Format;
+
+static const uint8_t opcodeFormats[256] = {
+    [OP_ADD] = FMT_RR, [OP_ADDI] = FMT_RI,
+    [OP_AND] = FMT_RR, [OP_ANDI] = FMT_RI,
+    [OP_BEQ] = FMT_I, [OP_BGE] = FMT_I, [OP_BGEU] = FMT_I, [OP_BGT] = FMT_I, [OP_BGTU] = FMT_I,
+    [OP_BLE] = FMT_I, [OP_BLEU] = FMT_I, [OP_BLT] = FMT_I, [OP_BLTU] = FMT_I, [OP_BNE] = FMT_I,
+    [OP_CMP] = FMT_RR, [OP_CMPI] = FMT_RI,
+    [OP_DIV] = FMT_RR, [OP_DIVI] = FMT_RI, [OP_DIVU] = FMT_RR,
+    [OP_JMP] = FMT_R, [OP_JMPA] = FMT_I, [OP_JSR] = FMT_R, [OP_JSRA] = FMT_I,
+    [OP_LD] = FMT_RR, [OP_LDA] = FMT_RI, [OP_LDI] = FMT_RI, [OP_LDR] = FMT_RR,
+    [OP_MUL] = FMT_RR, [OP_MULI] = FMT_RI, [OP_MULU] = FMT_RR,
+    [OP_NEG] = FMT_R, [OP_NOT] = FMT_R,
+    [OP_OR] = FMT_RR, [OP_ORI] = FMT_RI,
+    [OP_POP] = FMT_R, [OP_PUSH] = FMT_R,
+    [OP_STB] = FMT_RR, [OP_STA] = FMT_RI,
+    [OP_SUB] = FMT_RR, [OP_SUBI] = FMT_RI,
+    [OP_XOR] = FMT_RR, [OP_XORI] = FMT_RI,
+    [OP_RND] = FMT_RR, [OP_INT] = FMT_R,
+    [OP_LDBI] = FMT_RB, [OP_LDBA] = FMT_RI,
+};
+
+static const uint8_t formatLengths[] = {
+    [FMT_NONE] = 1,
+    [FMT_R] = 2,
+    [FMT_RR] = 3,
+    [FMT_RB] = 3,
+    [FMT_RI] = 6,
+    [FMT_I] = 5,
+};
+
+// Timing model. Every instruction costs CYCLES_EXECUTE, plus CYCLES_IMMEDIATE
+// for a 32-bit immediate or address operand and CYCLES_MEMORY for each data
+// access it makes. Multiply and divide add their latency, INT the cost of the
+// BIOS call, and a taken branch CYCLES_TAKEN to refill the prefetch queue.
+#define CYCLES_EXECUTE 2
+#define CYCLES_IMMEDIATE 1
+#define CYCLES_MEMORY 3
+#define CYCLES_MULTIPLY 10
+#define CYCLES_DIVIDE 36
+#define CYCLES_TAKEN 4
+#define CYCLES_INT 16
+
+#define CYCLES_RR CYCLES_EXECUTE
+#define CYCLES_RI (CYCLES_EXECUTE + CYCLES_IMMEDIATE)
+#define CYCLES_JUMP (CYCLES_EXECUTE + CYCLES_IMMEDIATE + CYCLES_TAKEN)
+#define CYCLES_IRQ (CYCLES_EXECUTE + 2 * CYCLES_MEMORY + CYCLES_TAKEN)
+
+static const uint8_t opcodeCycles[256] = {
+    [OP_NOP] = CYCLES_EXECUTE,
+    [OP_HALT] = CYCLES_EXECUTE,
+    [OP_ADD] = CYCLES_RR, [OP_ADDI] = CYCLES_RI,
+    [OP_AND] = CYCLES_RR, [OP_ANDI] = CYCLES_RI,
+    [OP_BEQ] = CYCLES_RI, [OP_BGE] = CYCLES_RI, [OP_BGEU] = CYCLES_RI, [OP_BGT] = CYCLES_RI, [OP_BGTU] = CYCLES_RI,
+    [OP_BLE] = CYCLES_RI, [OP_BLEU] = CYCLES_RI, [OP_BLT] = CYCLES_RI, [OP_BLTU] = CYCLES_RI, [OP_BNE] = CYCLES_RI,
+    [OP_CMP] = CYCLES_RR, [OP_CMPI] = CYCLES_RI,
+    [OP_DIV] = CYCLES_RR + CYCLES_DIVIDE, [OP_DIVI] = CYCLES_RI + CYCLES_DIVIDE, [OP_DIVU] = CYCLES_RR + CYCLES_DIVIDE,
+    [OP_JMP] = CYCLES_EXECUTE + CYCLES_MEMORY + CYCLES_TAKEN,
+    [OP_JMPA] = CYCLES_JUMP,
+    [OP_JSR] = CYCLES_EXECUTE + 2 * CYCLES_MEMORY + CYCLES_TAKEN,
+    [OP_JSRA] = CYCLES_JUMP + CYCLES_MEMORY,
+    [OP_LD] = CYCLES_RR,
+    [OP_LDA] = CYCLES_RI + CYCLES_MEMORY,
+    [OP_LDI] = CYCLES_RI,
+    [OP_LDR] = CYCLES_RR + CYCLES_MEMORY,
+    [OP_MUL] = CYCLES_RR + CYCLES_MULTIPLY, [OP_MULI] = CYCLES_RI + CYCLES_MULTIPLY, [OP_MULU] = CYCLES_RR + CYCLES_MULTIPLY,
+    [OP_NEG] = CYCLES_RR, [OP_NOT] = CYCLES_RR,
+    [OP_OR] = CYCLES_RR, [OP_ORI] = CYCLES_RI,
+    [OP_POP] = CYCLES_RR + CYCLES_MEMORY,
+    [OP_PUSH] = CYCLES_RR + CYCLES_MEMORY,
+    [OP_RET] = CYCLES_EXECUTE + CYCLES_MEMORY + CYCLES_TAKEN,
+    [OP_RTI] = CYCLES_IRQ,
+    [OP_STB] = CYCLES_RR + CYCLES_MEMORY,
+    [OP_STA] = CYCLES_RI + CYCLES_MEMORY,
+    [OP_SUB] = CYCLES_RR, [OP_SUBI] = CYCLES_RI,
+    [OP_XOR] = CYCLES_RR, [OP_XORI] = CYCLES_RI,
+    [OP_RND] = CYCLES_RR,
+    [OP_INT] = CYCLES_EXECUTE + CYCLES_INT,
+    [OP_LDBI] = CYCLES_RR,
+    [OP_LDBA] = CYCLES_RI + CYCLES_MEMORY,
+};
+
+// Extra cycles charged when a conditional branch is taken.
+static const uint8_t takenCycles[256] = {
+    [OP_BEQ] = CYCLES_TAKEN, [OP_BGE] = CYCLES_TAKEN, [OP_BGEU] = CYCLES_TAKEN, [OP_BGT] = CYCLES_TAKEN, [OP_BGTU] = CYCLES_TAKEN,
+    [OP_BLE] = CYCLES_TAKEN, [OP_BLEU] = CYCLES_TAKEN, [OP_BLT] = CYCLES_TAKEN, [OP_BLTU] = CYCLES_TAKEN, [OP_BNE] = CYCLES_TAKEN,
+};
+
+// Branches, jumps, calls, returns, INT and HLT end a basic block.
+static const bool endsBlock[256] = {
+    [OP_HALT] = true,
+    [OP_BEQ] = true, [OP_BGE] = true, [OP_BGEU] = true, [OP_BGT] = true, [OP_BGTU] = true,
+    [OP_BLE] = true, [OP_BLEU] = true, [OP_BLT] = true, [OP_BLTU] = true, [OP_BNE] = true,
+    [OP_JMP] = true, [OP_JMPA] = true, [OP_JSR] = true, [OP_JSRA] = true,
+    [OP_RET] = true, [OP_RTI] = true, [OP_INT] = true,
+};
+
+static inline void setFlags(PC32 *vm, FlagOp op, uint32_t a, uint32_t b) {
+    vm->flagOp = op;
+    vm->flagA = a;
+    vm->flagB = b;
+}
+
+// The machine currently running on this thread, if any. Guest accesses that
+// hit its guard region unwind back to run() or step().
+static __thread PC32 *faultMachine = NULL;
+
+static void onMemoryFault(int signal, siginfo_t *info, void *context) {
+    PC32 *vm = faultMachine;
+    uint8_t *address = info->si_addr;
+
+    if (vm && address >= vm->memory && address < vm->memory + ADDRESS_SPACE + GUARD_SIZE) {
+        vm->faultAddress = address - vm->memory;
+        siglongjmp(vm->faultJump, 1);
+    }
+
+    // Not a guest access, so let the fault take the host down as usual.
+    sigaction(SIGSEGV, &(struct sigaction){ .sa_handler = SIG_DFL }, NULL);
+}
+
+uint8_t readByte(PC32 *vm, uint32_t address) {
+    return vm->memory[address];
+}
+
+uint16_t readWord(PC32 *vm, uint32_t address) {
+    uint16_t value;
+    memcpy(&value, vm->memory + address, sizeof(value));
+    return BIG_ENDIAN_16(value);
+}
+
+uint32_t readLong(PC32 *vm, uint32_t address) {
+    uint32_t value;
+    memcpy(&value, vm->memory + address, sizeof(value));
+    return BIG_ENDIAN_32(value);
+}
+
+static void flushBlockCache(PC32 *vm) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        vm->blockCache[i].address = NO_ADDRESS;
+    }
+
+    memset(vm->codeMap, 0, vm->memorySize / 8 + 2);
+}
+
+static void markCode(PC32 *vm, uint32_t address, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t a = (address + i) % vm->memorySize;
+        vm->codeMap[a >> 3] |= 1 << (a & 7);
+    }
+}
+
+static void invalidateBlocks(PC32 *vm, uint32_t address, uint32_t size) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        Block *block = &vm->blockCache[i];
+
+        if (block->address != NO_ADDRESS && block->address < address + size && address < block->end) {
+            block->address = NO_ADDRESS;
+            vm->blockInvalidated = true;
+        }
+    }
+
+    // Every cached block covering these bytes is gone now.
+    for (uint32_t a = address; a < address + size; a++) {
+        vm->codeMap[a >> 3] &= ~(1 << (a & 7));
+    }
+}
+
+// Tests every byte of a store of up to 8 bytes against the code bitmap at once.
+static inline void invalidateCode(PC32 *vm, uint32_t address, uint32_t size) {
+    uint32_t bits = vm->codeMap[address >> 3] | (vm->codeMap[(address >> 3) + 1] << 8);
+
+    if ((bits >> (address & 7)) & ((1 << size) - 1)) {
+        invalidateBlocks(vm, address, size);
+    }
+}
+
+static inline void markLine(PC32 *vm, uint32_t offset) {
+    uint32_t line = offset / SCREEN_WIDTH;
+
+    vm->dirtyLines[line / 32] |= 1u << (line % 32);
+}
+
+// Checks both ends of a store, which can start below VRAM or cross a line.
+static inline void markVram(PC32 *vm, uint32_t address, uint32_t size) {
+    uint32_t first = address - VRAM(vm);
+    uint32_t last = first + size - 1;
+
+    if (first < VRAM_SIZE) {
+        markLine(vm, first);
+    }
+
+    if (last < VRAM_SIZE) {
+        markLine(vm, last);
+    }
+}
+
+void writeByte(PC32 *vm, uint32_t address, uint8_t value) {
+    vm->memory[address] = value;
+
+    invalidateCode(vm, address, 1);
+    markVram(vm, address, 1);
+}
+
+void writeWord(PC32 *vm, uint32_t address, uint16_t value) {
+    value = BIG_ENDIAN_16(value);
+    memcpy(vm->memory + address, &value, sizeof(value));
+
+    invalidateCode(vm, address, 2);
+    markVram(vm, address, 2);
+}
+
+void writeLong(PC32 *vm, uint32_t address, uint32_t value) {
+    value = BIG_ENDIAN_32(value);
+    memcpy(vm->memory + address, &value, sizeof(value));
+
+    invalidateCode(vm, address, 4);
+    markVram(vm, address, 4);
+}
+
+static void decode(PC32 *vm, Instruction *in, uint32_t address) {
+    // Operands follow the opcode, which wraps around the end of memory.
+    uint32_t operand = address + 1 >= vm->memorySize ? 0 : address + 1;
+
+    in->address = address;
+    in->opcode = readByte(vm, address);
+    in->r1 = 0;
+    in->r2 = 0;
+    in->imm = 0;
+    in->length = formatLengths[opcodeFormats[in->opcode]];
+    in->cycles = opcodeCycles[in->opcode];
+    in->taken = takenCycles[in->opcode];
+    in->instructions = 1;
+
+    switch (opcodeFormats[in->opcode]) {
+    case FMT_R:
+        in->r1 = readByte(vm, operand);
+        break;
+    case FMT_RR:
+        in->r1 = readByte(vm, operand);
+        in->r2 = readByte(vm, operand + 1);
+        break;
+    case FMT_RB:
+        in->r1 = readByte(vm, operand);
+        in->imm = readByte(vm, operand + 1);
+        break;
+    case FMT_RI:
+        in->r1 = readByte(vm, operand);
+        in->imm = readLong(vm, operand + 1);
+        break;
+    case FMT_I:
+        in->imm = readLong(vm, operand);
+        break;
+    }
+
+    markCode(vm, address, in->length);
+}
+
+// Merges in into the previous instruction when the pair forms a
+// superinstruction. The fused instruction keeps the combined length and cost.
+static bool fuse(Instruction *previous, Instruction *in) {
+    uint8_t fused;
+
+    if ((previous->opcode == OP_CMP || previous->opcode == OP_CMPI) && fusedCompares[in->opcode]) {
+        fused = fusedCompares[in->opcode] + (previous->opcode == OP_CMPI ? CMPI_FUSED_OFFSET : 0);
+        previous->target = in->imm;
+        previous->taken = in->taken;
+    } else if (previous->opcode == OP_LDI && in->opcode == OP_INT && in->r1 != INT_KEYBOARD) {
+        fused = OP_LDI_INT;
+        previous->r2 = in->r1;
+    } else {
+        return false;
+    }
+
+    previous->opcode = fused;
+    previous->length += in->length;
+    previous->cycles += in->cycles;
+    previous->instructions += in->instructions;
+
+    return true;
+}
+
+// Translates straight-line code starting at address into block, stopping at
+// the first control transfer or after limit instructions.
+static void buildBlock(PC32 *vm, Block *block, uint32_t address, int limit) {
+    block->address = address;
+    block->count = 0;
+
+    do {
+        Instruction *in = &block->code[block->count++];
+
+        decode(vm, in, address);
+
+        address += in->length;
+
+        bool last = endsBlock[in->opcode] || address >= vm->memorySize;
+
+        if (block->count > 1 && fuse(in - 1, in)) {
+            block->count--;
+        }
+
+        if (last) {
+            break;
+        }
+    } while (block->count < limit);
+
+    block->end = address;
+}
+
+static inline Block *findBlock(PC32 *vm, uint32_t address) {
+    Block *block = &vm->blockCache[address & (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->address != address) {
+        buildBlock(vm, block, address, MAX_BLOCK_LENGTH);
+    }
+
+    return block;
+}
+
+static void push(PC32 *vm, uint32_t value) {
+    vm->sp -= 4;
+    writeLong(vm, vm->sp, value);
+}
+
+static uint32_t pop(PC32 *vm) {
+    uint32_t value = readLong(vm, vm->sp);
+    vm->sp += 4;
+    return value;
+}
+
+// RAM is anonymous memory, so the host only commits the pages the guest
+// actually touches, whatever the configured size. The machine is empty until
+// the caller picks a program and calls reset().
+// Machines may be created from several threads at once, as batch workers do,
+// so the process-wide handler is installed exactly once.
+static pthread_once_t handlerOnce = PTHREAD_ONCE_INIT;
+
+static void installFaultHandler(void) {
+    struct sigaction action = { 0 };
+    action.sa_sigaction = onMemoryFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+}
+
+PC32 *createMachine(uint32_t memorySize) {
+    PC32 *vm = calloc(1, sizeof(PC32));
+
+    if (!vm) {
+        return NULL;
+    }
+
+    vm->memorySize = memorySize;
+    vm->memory = mmap(NULL, ADDRESS_SPACE + GUARD_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (vm->memory == MAP_FAILED || mprotect(vm->memory, memorySize, PROT_READ | PROT_WRITE) != 0) {
+        free(vm);
+        return NULL;
+    }
+
+    vm->blockCache = calloc(BLOCK_CACHE_SIZE, sizeof(Block));
+    vm->codeMap = calloc(memorySize / 8 + 2, 1);
+
+    if (!vm->blockCache || !vm->codeMap) {
+        destroyMachine(vm);
+        return NULL;
+    }
+
+    vm->speed = 1.0f;
+    vm->program = "out.bin";
+    vm->random = RANDOM_SEED;
+    vm->passCycles = -1;
+
+    pthread_once(&handlerOnce, installFaultHandler);
+
+    flushBlockCache(vm);
+
+    return vm;
+}
+
+void destroyMachine(PC32 *vm) {
+    munmap(vm->memory, ADDRESS_SPACE + GUARD_SIZE);
+    free(vm->blockCache);
+    free(vm->codeMap);
+    free(vm);
+}
+
+static void swapEvents(PC32 *vm, int a, int b) {
+    Event event = vm->events[a];
+    vm->events[a] = vm->events[b];
+    vm->events[b] = event;
+}
+
+static void removeEvent(PC32 *vm, int i) {
+    vm->events[i] = vm->events[--vm->eventCount];
+
+    while (i > 0 && vm->events[i].time < vm->events[(i - 1) / 2].time) {
+        swapEvents(vm, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if (left < vm->eventCount && vm->events[left].time < vm->events[smallest].time) {
+            smallest = left;
+        }
+
+        if (right < vm->eventCount && vm->events[right].time < vm->events[smallest].time) {
+            smallest = right;
+        }
+
+        if (smallest == i) {
+            break;
+        }
+
+        swapEvents(vm, i, smallest);
+        i = smallest;
+    }
+}
+
+void cancelEvent(PC32 *vm, EventType type) {
+    for (int i = 0; i < vm->eventCount; i++) {
+        if (vm->events[i].type == type) {
+            removeEvent(vm, i);
+            return;
+        }
+    }
+}
+
+// Each device has at most one event pending, so scheduling replaces it.
+void scheduleEvent(PC32 *vm, EventType type, uint64_t time) {
+    cancelEvent(vm, type);
+
+    int i = vm->eventCount++;
+    vm->events[i] = (Event){ time, type };
+
+    while (i > 0 && vm->events[i].time < vm->events[(i - 1) / 2].time) {
+        swapEvents(vm, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Masked IRQs are dropped rather than held until they are unmasked. The
+// keyboard IRQ is not raised here but follows the key queue.
+void raiseIrq(PC32 *vm, Irq irq) {
+    if (vm->irqMask & (1 << irq)) {
+        vm->irqPending |= 1 << irq;
+    }
+}
+
+// The timer always wakes a halted CPU; vblank and the keyboard only do
+// through an enabled interrupt.
+static bool canWake(PC32 *vm) {
+    uint32_t sources = (1 << IRQ_VBLANK) | (1 << IRQ_KEYBOARD);
+
+    return vm->timerPeriod > 0 || (vm->interruptsEnabled && (vm->irqMask & sources));
+}
+
+// Queues a key from the host, which must be the thread running the machine,
+// and hands it straight over if the guest is waiting in INT 0. Returns false
+// and drops the key if the queue is full.
+bool pressKey(PC32 *vm, int key) {
+    if (vm->keyTail - vm->keyHead == KEY_QUEUE_SIZE) {
+        return false;
+    }
+
+    vm->keyQueue[vm->keyTail++ % KEY_QUEUE_SIZE] = key;
+
+    if (!vm->running && vm->interrupt == INT_KEYBOARD) {
+        handleInterrupts(vm);
+    }
+
+    return true;
+}
+
+// Schedules a key to be pressed once the guest has run until time, after
+// the keys scheduled before it. Returns false if too many are waiting.
+bool scheduleKey(PC32 *vm, uint64_t time, int key) {
+    if (vm->timedTail - vm->timedHead == KEY_QUEUE_SIZE) {
+        return false;
+    }
+
+    if (vm->timedHead == vm->timedTail) {
+        scheduleEvent(vm, EVENT_KEY, time);
+    }
+
+    vm->timedKeys[vm->timedTail++ % KEY_QUEUE_SIZE] = (TimedKey){ time, key };
+
+    return true;
+}
+
+static uint32_t statusWord(PC32 *vm) {
+    return (zeroFlag(vm) ? STATUS_ZERO : 0) |
+        (carryFlag(vm) ? STATUS_CARRY : 0) |
+        (overflowFlag(vm) ? STATUS_OVERFLOW : 0) |
+        (negativeFlag(vm) ? STATUS_NEGATIVE : 0) |
+        (vm->interruptsEnabled ? STATUS_INTERRUPTS : 0);
+}
+
+// Periodic devices reschedule from the time they were due rather than the
+// time they were serviced, so their period does not drift.
+static void onVblank(PC32 *vm, uint64_t time) {
+    vm->ticks++;
+    raiseIrq(vm, IRQ_VBLANK);
+
+    scheduleEvent(vm, EVENT_VBLANK, time + (vm->cyclesPerFrame > 0 ? vm->cyclesPerFrame : 1));
+}
+
+static void onTimer(PC32 *vm, uint64_t time) {
+    vm->halted = false;
+    raiseIrq(vm, IRQ_TIMER);
+    scheduleEvent(vm, EVENT_TIMER, time + vm->timerPeriod);
+}
+
+// Presses the scheduled keys that are due. One that does not fit in the
+// queue is tried again a frame later.
+static void onKey(PC32 *vm, uint64_t time) {
+    while (vm->timedHead != vm->timedTail) {
+        TimedKey *next = &vm->timedKeys[vm->timedHead % KEY_QUEUE_SIZE];
+
+        if (next->time > time) {
+            scheduleEvent(vm, EVENT_KEY, next->time);
+            return;
+        }
+
+        if (!pressKey(vm, next->key)) {
+            scheduleEvent(vm, EVENT_KEY, time + (vm->cyclesPerFrame > 0 ? vm->cyclesPerFrame : 1));
+            return;
+        }
+
+        vm->timedHead++;
+    }
+}
+
+static void (*const eventHandlers[])(PC32 *vm, uint64_t time) = {
+    [EVENT_VBLANK] = onVblank,
+    [EVENT_TIMER] = onTimer,
+    [EVENT_KEY] = onKey,
+};
+
+// Fires every event that is due.
+static void serviceEvents(PC32 *vm) {
+    while (vm->eventCount > 0 && vm->events[0].time <= vm->cycleCount) {
+        Event event = vm->events[0];
+
+        removeEvent(vm, 0);
+        eventHandlers[event.type](vm, event.time);
+    }
+}
+
+// Cycles until the next event is due, at most limit and at least 1 should
+// one be overdue.
+static int untilEvent(PC32 *vm, int limit) {
+    if (vm->eventCount > 0 && vm->events[0].time <= vm->cycleCount) {
+        return 1;
+    }
+
+    if (vm->eventCount > 0 && vm->events[0].time - vm->cycleCount < (uint64_t)limit) {
+        return vm->events[0].time - vm->cycleCount;
+    }
+
+    return limit;
+}
+
+// Takes the lowest pending IRQ, if interrupts are enabled: pushes PC and
+// the status word, disables interrupts and jumps through the vector table.
+// The keyboard IRQ is level-triggered, pending whenever keys are queued,
+// so it is neither lost while masked nor left pending once they are taken.
+static int serviceIrqs(PC32 *vm) {
+    uint32_t keyboard = vm->keyHead != vm->keyTail ? 1 << IRQ_KEYBOARD : 0;
+    uint32_t irqs = (vm->irqPending | keyboard) & vm->irqMask;
+
+    if (irqs == 0 || !vm->interruptsEnabled) {
+        return 0;
+    }
+
+    int irq = __builtin_ctz(irqs);
+
+    vm->irqPending &= ~(1 << irq);
+
+    push(vm, vm->pc);
+    push(vm, statusWord(vm));
+
+    vm->interruptsEnabled = false;
+    vm->halted = false;
+    vm->pc = readLong(vm, vm->vectors + 4 * irq);
+    vm->cycleCount += CYCLES_IRQ;
+
+    // The entry sequence takes time too and may carry an event past due.
+    serviceEvents(vm);
+
+    return CYCLES_IRQ;
+}
+
+// A halted CPU does nothing until the next event, so guest time skips
+// straight to it.
+static int idle(PC32 *vm, int limit) {
+    int cycles = untilEvent(vm, limit);
+
+    vm->cycleCount += cycles;
+    serviceEvents(vm);
+
+    return cycles;
+}
+
+// xorshift32, so RND sequences are reproducible per machine.
+static inline uint32_t nextRandom(PC32 *vm) {
+    uint32_t x = vm->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return vm->random = x;
+}
+
+void setSpeed(PC32 *vm, float speed) {
+    vm->speed = speed;
+    vm->cyclesPerFrame = (int)(vm->speed * 1000000 / REFRESH_RATE);
+}
+
+void reset(PC32 *vm) {
+    vm->pc = 0;
+    vm->sp = VRAM(vm) - 4;
+
+    for (int i = 0; i < 16; i++) {
+        vm->reg[i] = 0;
+    }
+
+    // Hand the pages back to the host; they read as zero when touched again.
+    madvise(vm->memory, vm->memorySize, MADV_DONTNEED);
+
+    flushBlockCache(vm);
+
+    setSpeed(vm, vm->speed);
+
+    setFlags(vm, FLAGS_LOGIC, 1, 0);
+
+    vm->running = false;
+
+    vm->videoMode = VM_TEXT;
+
+    vm->interrupt = -1;
+    vm->pending = false;
+    vm->faulted = false;
+
+    vm->cycleCount = 0;
+    vm->instructionCount = 0;
+    vm->passCycles = -1;
+
+    vm->eventCount = 0;
+    vm->halted = false;
+    vm->timerPeriod = 0;
+    vm->ticks = 0;
+
+    vm->vectors = 0;
+    vm->irqMask = 0;
+    vm->irqPending = 0;
+    vm->interruptsEnabled = true;
+
+    vm->keyHead = 0;
+    vm->keyTail = 0;
+    vm->timedHead = 0;
+    vm->timedTail = 0;
+
+    // The program is loaded without going through the stores.
+    memset(vm->dirtyLines, 0xFF, sizeof(vm->dirtyLines));
+
+    scheduleEvent(vm, EVENT_VBLANK, vm->cyclesPerFrame > 0 ? vm->cyclesPerFrame : 1);
+
+    vm->cursorX = 0;
+    vm->cursorY = 0;
+    vm->textAttribute = 0;
+    vm->blink = true;
+
+    FILE *file = fopen(vm->program, "rb");
+
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        fread(vm->memory, 1, size < vm->memorySize ? size : vm->memorySize, file);
+        fclose(file);
+    }
+}
+
+// Writes a character with the current attribute at the cursor. A cursor
+// set off the screen writes nothing, rather than into the attribute plane
+// or past the end of VRAM.
+static void writeCell(PC32 *vm, uint8_t c) {
+    uint32_t cell = vm->cursorX + vm->cursorY * TEXT_COLUMNS;
+
+    if (cell >= TEXT_CELLS) {
+        return;
+    }
+
+    writeByte(vm, VRAM(vm) + cell, c);
+    writeByte(vm, TEXT_ATTRIBUTES(vm) + cell, vm->textAttribute);
+}
+
+void handleInterrupts(PC32 *vm) {
+    switch (vm->interrupt) {
+        case INT_KEYBOARD:
+            // Guest time stands still while the machine waits, so a key
+            // scheduled for later is taken straight away.
+            if (vm->keyHead == vm->keyTail && vm->timedHead != vm->timedTail) {
+                vm->keyQueue[vm->keyTail++ % KEY_QUEUE_SIZE] = vm->timedKeys[vm->timedHead++ % KEY_QUEUE_SIZE].key;
+            }
+
+            // With the queue empty the machine waits until pressKey().
+            if (vm->keyHead == vm->keyTail) {
+                vm->running = false;
+            } else {
+                vm->reg[0] = vm->keyQueue[vm->keyHead++ % KEY_QUEUE_SIZE];
+                vm->running = true;
+                vm->interrupt = -1;
+            }
+
+            break;
+        case INT_VIDEOMODE:
+            vm->videoMode = vm->reg[0];
+            vm->interrupt = -1;
+            break;
+        case INT_SETCURPOS:
+            vm->cursorX = vm->reg[0];
+            vm->cursorY = vm->reg[1];
+            vm->interrupt = -1;
+            break;
+        case INT_GETCURPOS:
+            vm->reg[0] = vm->cursorX;
+            vm->reg[1] = vm->cursorY;
+            vm->interrupt = -1;
+            break;
+        case INT_WRITECHAR:
+            writeCell(vm, vm->reg[0]);
+            vm->cursorX++;
+            vm->interrupt = -1;
+            break;
+        case INT_SETPIXEL:
+            writeByte(vm, VRAM(vm) + vm->reg[0] + vm->reg[1] * 640, vm->reg[2]);
+            vm->interrupt = -1;
+            break;
+        case INT_GETPIXEL:
+            vm->reg[0] = readByte(vm, VRAM(vm) + vm->reg[1] + vm->reg[2] * 640);
+            vm->interrupt = -1;
+            break;
+        case INT_WRITESTR:
+            for (int i = 0; i < vm->reg[1]; i++) {
+                writeCell(vm, readByte(vm, vm->reg[0] + i));
+
+                if (vm->cursorX == 80) {
+                    vm->cursorX = 0;
+                    vm->cursorY++;
+                } else {
+                    vm->cursorX++;
+                }
+
+                if (VRAM(vm) + vm->cursorX + vm->cursorY * 80 >= VRAM(vm) + SCREEN_WIDTH / 8 * SCREEN_HEIGHT / 8) {
+                    vm->cursorX = 0;
+                    vm->cursorY = 0;
+                }
+            }
+
+            vm->interrupt = -1;
+            break;
+        case INT_SETTIMER:
+            vm->timerPeriod = vm->reg[0];
+
+            if (vm->timerPeriod > 0) {
+                scheduleEvent(vm, EVENT_TIMER, vm->cycleCount + vm->timerPeriod);
+            } else {
+                cancelEvent(vm, EVENT_TIMER);
+            }
+
+            vm->interrupt = -1;
+            break;
+        case INT_GETTICKS:
+            vm->reg[0] = vm->ticks;
+            vm->interrupt = -1;
+            break;
+        case INT_SETVECTORS:
+            vm->vectors = vm->reg[0];
+            vm->interrupt = -1;
+            break;
+        case INT_SETMASK:
+            vm->irqMask = vm->reg[0];
+            vm->irqPending &= vm->irqMask;
+            vm->interrupt = -1;
+            break;
+        case INT_KEYSTATUS:
+            vm->reg[0] = vm->keyTail - vm->keyHead;
+            vm->interrupt = -1;
+            break;
+        case INT_SETATTR:
+            vm->textAttribute = vm->reg[0];
+            vm->interrupt = -1;
+            break;
+        case INT_SETBLINK:
+            vm->blink = vm->reg[0] != 0;
+            vm->interrupt = -1;
+            break;
+        case INT_WRITENUM:
+            char str[16];
+            sprintf(str, "%d", vm->reg[0]);
+
+            for (int i = 0; i < strlen(str); i++) {
+                writeCell(vm, str[i]);
+
+                if (vm->cursorX == 80) {
+                    vm->cursorX = 0;
+                    vm->cursorY++;
+                } else {
+                    vm->cursorX++;
+                }
+
+                if (VRAM(vm) + vm->cursorX + vm->cursorY * 80 >= VRAM(vm) + SCREEN_WIDTH / 8 * SCREEN_HEIGHT / 8) {
+                    vm->cursorX = 0;
+                    vm->cursorY = 0;
+                }
+            }
+
+            vm->interrupt = -1;
+            break;
+    }
+}
+
+// Blocks are looked up (and translated on a miss) only when the previous one
+// runs out, which is also the only place pending events are noticed. A zero
+// budget single-steps through a one-instruction block that is never cached.
+#define ENTER_BLOCK() \
+    vm->activeBlock = NULL; \
+    vm->passCycles = cycles; \
+    vm->passInstructions = instructions; \
+    block = budget > 0 ? findBlock(vm, vm->pc) : (buildBlock(vm, &vm->single, vm->pc, 1), &vm->single); \
+    vm->activeBlock = block; \
+    in = block->code; \
+    end = in + block->count;
+
+#define FETCH() \
+    cycles += in->cycles; \
+    instructions += in->instructions; \
+    r1 = in->r1; \
+    r2 = in->r2; \
+    imm = in->imm; \
+    vm->pc += in->length; \
+    if (vm->pc >= vm->memorySize) { \
+        vm->pc -= vm->memorySize; \
+    }
+
+#define LEAVE() \
+    vm->passCycles = -1; \
+    vm->instructionCount += instructions; \
+    return cycles
+
+// The interpreter body is written once and dispatched either through a plain
+// switch or, with PC32_THREADED_DISPATCH, through a table of label addresses
+// so that every handler ends in its own indirect branch.
+#ifdef PC32_THREADED_DISPATCH
+#define HANDLER(op) [op] = &&L_##op
+#define DISPATCH() ENTER_BLOCK(); FETCH(); goto *handlers[in->opcode];
+#define CASE(op) L_##op
+#define DEFAULT L_DEFAULT
+#define NEXT() \
+    if (++in == end) { \
+        if (vm->pending || cycles >= budget) { \
+            LEAVE(); \
+        } \
+        ENTER_BLOCK(); \
+    } \
+    FETCH(); \
+    goto *handlers[in->opcode]
+#define END_DISPATCH()
+#else
+#define DISPATCH() ENTER_BLOCK(); for (;;) { FETCH(); switch (in->opcode) {
+#define CASE(op) case op
+#define DEFAULT default
+#define NEXT() break
+#define END_DISPATCH() \
+    } \
+    if (++in == end) { \
+        if (vm->pending || cycles >= budget) { \
+            LEAVE(); \
+        } \
+        ENTER_BLOCK(); \
+    } \
+    }
+#endif
+
+// A store may have overwritten the rest of the running block, so leave it and
+// translate again from pc.
+#define CHECK_CODE_WRITE() \
+    if (vm->blockInvalidated) { \
+        vm->blockInvalidated = false; \
+        end = in + 1; \
+    }
+
+// Runs instructions until at least budget cycles have elapsed or an event is
+// pending, and returns the number of cycles actually spent. At least one
+// instruction is always run.
+static int execute(PC32 *vm, int budget) {
+    int cycles = 0;
+    int instructions = 0;
+
+    Block *block;
+    Instruction *in = NULL;
+    Instruction *end = NULL;
+    uint8_t r1, r2;
+    uint32_t imm;
+
+#ifdef PC32_THREADED_DISPATCH
+    static void *handlers[256] = {
+        [0 ... 255] = &&L_DEFAULT,
+        HANDLER(OP_NOP), HANDLER(OP_HALT),
+        HANDLER(OP_ADD), HANDLER(OP_ADDI), HANDLER(OP_AND), HANDLER(OP_ANDI),
+        HANDLER(OP_BEQ), HANDLER(OP_BGE), HANDLER(OP_BGEU), HANDLER(OP_BGT), HANDLER(OP_BGTU),
+        HANDLER(OP_BLE), HANDLER(OP_BLEU), HANDLER(OP_BLT), HANDLER(OP_BLTU), HANDLER(OP_BNE),
+        HANDLER(OP_CMP), HANDLER(OP_CMPI), HANDLER(OP_DIV), HANDLER(OP_DIVI), HANDLER(OP_DIVU),
+        HANDLER(OP_JMP), HANDLER(OP_JMPA), HANDLER(OP_JSR), HANDLER(OP_JSRA),
+        HANDLER(OP_LD), HANDLER(OP_LDA), HANDLER(OP_LDI), HANDLER(OP_LDR),
+        HANDLER(OP_MUL), HANDLER(OP_MULI), HANDLER(OP_MULU), HANDLER(OP_NEG), HANDLER(OP_NOT),
+        HANDLER(OP_OR), HANDLER(OP_ORI), HANDLER(OP_POP), HANDLER(OP_PUSH), HANDLER(OP_RET),
+        HANDLER(OP_STB), HANDLER(OP_STA), HANDLER(OP_SUB), HANDLER(OP_SUBI),
+        HANDLER(OP_XOR), HANDLER(OP_XORI), HANDLER(OP_RND), HANDLER(OP_INT),
+        HANDLER(OP_LDBI), HANDLER(OP_LDBA), HANDLER(OP_RTI),
+        HANDLER(OP_CMP_EQ), HANDLER(OP_CMP_NE), HANDLER(OP_CMP_LT), HANDLER(OP_CMP_LE), HANDLER(OP_CMP_GE),
+        HANDLER(OP_CMPI_EQ), HANDLER(OP_CMPI_NE), HANDLER(OP_CMPI_LT), HANDLER(OP_CMPI_LE), HANDLER(OP_CMPI_GE),
+        HANDLER(OP_LDI_INT),
+    };
+#endif
+
+    DISPATCH()
+    CASE(OP_NOP):
+        NEXT();
+    CASE(OP_ADD):
+        setFlags(vm, FLAGS_ADD, vm->reg[r1], vm->reg[r2]);
+        vm->reg[r1] += vm->reg[r2];
+        NEXT();
+    CASE(OP_ADDI):
+        setFlags(vm, FLAGS_ADD, vm->reg[r1], imm);
+        vm->reg[r1] += imm;
+        NEXT();
+    CASE(OP_AND):
+        vm->reg[r1] &= vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_ANDI):
+        vm->reg[r1] &= imm;
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_BEQ):
+        if (zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BGE):
+        if (negativeFlag(vm) || zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BGEU):
+        if (carryFlag(vm) || zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BGT):
+        if (negativeFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BGTU):
+        if (negativeFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BLE):
+        if (!negativeFlag(vm) || zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BLEU):
+        if (!negativeFlag(vm) || zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BLT):
+        if (negativeFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BLTU):
+        if (negativeFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_BNE):
+        if (!zeroFlag(vm)) {
+            vm->pc = imm;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMP):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+        NEXT();
+    CASE(OP_CMPI):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+        NEXT();
+    CASE(OP_DIV):
+        vm->reg[r1] = (int)(vm->reg[r1] / vm->reg[r2]);
+        vm->reg[0] = vm->reg[r1] % vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_DIVI):
+        vm->reg[r1] = (int)(vm->reg[r1] / imm);
+        vm->reg[0] = vm->reg[r1] % imm;
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_DIVU):
+        vm->reg[r1] = (int)(vm->reg[r1] / vm->reg[r2]);
+        vm->reg[0] = vm->reg[r1] % vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_JMP):
+        vm->pc = readLong(vm, vm->reg[r1]);
+        NEXT();
+    CASE(OP_JMPA):
+        vm->pc = imm;
+        NEXT();
+    CASE(OP_JSR):
+        push(vm, vm->pc);
+        vm->pc = readLong(vm, vm->reg[r1]);
+        NEXT();
+    CASE(OP_JSRA):
+        push(vm, vm->pc);
+        vm->pc = imm;
+        NEXT();
+    CASE(OP_LD):
+        vm->reg[r1] = vm->reg[r2];
+        NEXT();
+    CASE(OP_LDA):
+        vm->reg[r1] = readLong(vm, imm);
+        NEXT();
+    CASE(OP_LDBA):
+        vm->reg[r1] = readByte(vm, imm);
+        NEXT();
+    CASE(OP_LDI):
+    CASE(OP_LDBI):
+        vm->reg[r1] = imm;
+        NEXT();
+    CASE(OP_LDR):
+        vm->reg[r1] = readLong(vm, vm->reg[r2]);
+        NEXT();
+    CASE(OP_MUL):
+        vm->reg[r1] *= vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_MULI):
+        vm->reg[r1] *= imm;
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_MULU):
+        vm->reg[r1] *= vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_NEG):
+        setFlags(vm, FLAGS_SUB, 0, vm->reg[r1]);
+        vm->reg[r1] = -vm->reg[r1];
+        NEXT();
+    CASE(OP_NOT):
+        vm->reg[r1] = ~vm->reg[r1];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_OR):
+        vm->reg[r1] |= vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_ORI):
+        vm->reg[r1] |= imm;
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_POP):
+        vm->reg[r1] = pop(vm);
+        NEXT();
+    CASE(OP_PUSH):
+        push(vm, vm->reg[r1]);
+        CHECK_CODE_WRITE();
+        NEXT();
+    CASE(OP_RET):
+        vm->pc = pop(vm);
+        NEXT();
+    CASE(OP_RTI):
+        setFlags(vm, FLAGS_STATUS, pop(vm), 0);
+        vm->pc = pop(vm);
+        vm->interruptsEnabled = vm->flagA & STATUS_INTERRUPTS;
+
+        // Let run() take anything that became pending in the handler.
+        vm->pending = true;
+        NEXT();
+    CASE(OP_STB):
+        writeByte(vm, vm->reg[r2], vm->reg[r1]);
+        CHECK_CODE_WRITE();
+        NEXT();
+    CASE(OP_STA):
+        writeLong(vm, imm, vm->reg[r1]);
+        CHECK_CODE_WRITE();
+        NEXT();
+    CASE(OP_SUB):
+        setFlags(vm, FLAGS_SUB, vm->reg[r1], vm->reg[r2]);
+        vm->reg[r1] -= vm->reg[r2];
+        NEXT();
+    CASE(OP_SUBI):
+        setFlags(vm, FLAGS_SUB, vm->reg[r1], imm);
+        vm->reg[r1] -= imm;
+        NEXT();
+    CASE(OP_XOR):
+        vm->reg[r1] ^= vm->reg[r2];
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_XORI):
+        vm->reg[r1] ^= imm;
+        setFlags(vm, FLAGS_LOGIC, vm->reg[r1], 0);
+        NEXT();
+    CASE(OP_HALT):
+        // If nothing could ever wake the CPU, the machine just stops.
+        if (canWake(vm)) {
+            vm->halted = true;
+        } else {
+            vm->running = false;
+        }
+
+        vm->pending = true;
+        NEXT();
+    CASE(OP_RND):
+        vm->reg[r1] = nextRandom(vm) % (r2 + 1);
+        NEXT();
+    CASE(OP_INT):
+        vm->interrupt = r1;
+        vm->pending = true;
+        NEXT();
+    CASE(OP_CMP_EQ):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+
+        if (vm->reg[r1] == vm->reg[r2]) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMP_NE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+
+        if (vm->reg[r1] != vm->reg[r2]) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMP_LT):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+
+        if (vm->reg[r1] < vm->reg[r2]) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMP_LE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+
+        if (vm->reg[r1] <= vm->reg[r2]) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMP_GE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], vm->reg[r2]);
+
+        if (vm->reg[r1] >= vm->reg[r2]) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMPI_EQ):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+
+        if (vm->reg[r1] == imm) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMPI_NE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+
+        if (vm->reg[r1] != imm) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMPI_LT):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+
+        if (vm->reg[r1] < imm) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMPI_LE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+
+        if (vm->reg[r1] <= imm) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_CMPI_GE):
+        setFlags(vm, FLAGS_CMP, vm->reg[r1], imm);
+
+        if (vm->reg[r1] >= imm) {
+            vm->pc = in->target;
+            cycles += in->taken;
+        }
+
+        NEXT();
+    CASE(OP_LDI_INT):
+        vm->reg[r1] = imm;
+        vm->interrupt = r2;
+        vm->pending = true;
+        NEXT();
+    DEFAULT:
+        fprintf(stderr, "Unknown opcode: %02X\n", in->opcode);
+        NEXT();
+    END_DISPATCH()
+}
+
+// pc is advanced before an instruction runs, so the faulting instruction is
+// the one in the active block that ends at pc. Faults while translating a
+// block happen with no active block and pc at the code being fetched.
+static uint32_t faultPc(PC32 *vm) {
+    if (vm->activeBlock) {
+        for (int i = 0; i < vm->activeBlock->count; i++) {
+            Instruction *in = &vm->activeBlock->code[i];
+
+            if ((in->address + in->length) % vm->memorySize == vm->pc) {
+                return in->address;
+            }
+        }
+    }
+
+    return vm->pc;
+}
+
+// Counts the blocks the interrupted pass had finished and the active one up
+// to the faulting instruction, whose cost FETCH had already charged. A fault
+// while decoding the next block leaves no active block to count. Returns
+// the cycles spent.
+static int faultedPass(PC32 *vm) {
+    if (vm->passCycles < 0) {
+        return 0;
+    }
+
+    int cycles = vm->passCycles;
+    int instructions = vm->passInstructions;
+
+    for (int i = 0; vm->activeBlock && i < vm->activeBlock->count; i++) {
+        Instruction *in = &vm->activeBlock->code[i];
+
+        cycles += in->cycles;
+        instructions += in->instructions;
+
+        if ((in->address + in->length) % vm->memorySize == vm->pc) {
+            break;
+        }
+    }
+
+    vm->passCycles = -1;
+    vm->cycleCount += cycles;
+    vm->instructionCount += instructions;
+
+    return cycles;
+}
+
+static int memoryFault(PC32 *vm) {
+    faultMachine = NULL;
+
+    fprintf(stderr, "Memory fault at PC 0x%08X: invalid address 0x%08X\n", faultPc(vm), vm->faultAddress);
+
+    vm->faulted = true;
+    vm->running = false;
+    vm->interrupt = -1;
+
+    return faultedPass(vm);
+}
+
+int step(PC32 *vm) {
+    if (sigsetjmp(vm->faultJump, 1)) {
+        return memoryFault(vm);
+    }
+
+    faultMachine = vm;
+
+    int cycles;
+
+    // Stepping a halted CPU moves on to the next event.
+    if (vm->halted) {
+        cycles = idle(vm, INT32_MAX);
+    } else {
+        cycles = execute(vm, 0);
+        vm->cycleCount += cycles;
+        serviceEvents(vm);
+    }
+
+    handleInterrupts(vm);
+
+    cycles += serviceIrqs(vm);
+
+    faultMachine = NULL;
+
+    return cycles;
+}
+
+// Runs the machine for about cycles cycles. The interpreter only checks its
+// budget between blocks and only drops out of its loop for INT, HLT or the
+// end of the budget, so BIOS calls and device events are serviced here
+// rather than after every instruction. Each pass is cut short at the next
+// event, which therefore fires at the first block boundary after it is due.
+int run(PC32 *vm, int cycles) {
+    volatile int elapsed = 0;
+
+    if (sigsetjmp(vm->faultJump, 1)) {
+        return elapsed + memoryFault(vm);
+    }
+
+    faultMachine = vm;
+
+    serviceEvents(vm);
+
+    while (vm->running && elapsed < cycles) {
+        elapsed += serviceIrqs(vm);
+
+        if (vm->halted) {
+            elapsed += idle(vm, cycles - elapsed);
+        } else {
+            vm->pending = false;
+
+            int ran = execute(vm, untilEvent(vm, cycles - elapsed));
+
+            elapsed += ran;
+            vm->cycleCount += ran;
+
+            serviceEvents(vm);
+
+            handleInterrupts(vm);
+        }
+    }
+
+    faultMachine = NULL;
+
+    return elapsed;
+}
+
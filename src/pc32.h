@@ -0,0 +1,294 @@
+#ifndef PC32_H
+#define PC32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#define MIN_MEMORY (1 << 20)
+#define MAX_MEMORY (16 << 20)
+#define REFRESH_RATE 60
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 480
+#define VRAM_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define VRAM(vm) ((vm)->memorySize - VRAM_SIZE)
+#define TEXT_COLUMNS (SCREEN_WIDTH / 8)
+#define TEXT_ROWS (SCREEN_HEIGHT / 8)
+#define TEXT_CELLS (TEXT_COLUMNS * TEXT_ROWS)
+// In text mode one character per cell is followed by one attribute per cell.
+#define TEXT_ATTRIBUTES(vm) (VRAM(vm) + TEXT_CELLS)
+#define RANDOM_SEED 0x2545F491
+
+// GCC-compatible compilers dispatch through a table of label addresses.
+// Define PC32_SWITCH_DISPATCH to force the portable switch.
+#if defined(__GNUC__) && !defined(PC32_SWITCH_DISPATCH)
+#define PC32_THREADED_DISPATCH
+#endif
+
+#define BLOCK_CACHE_SIZE (1 << 12)
+#define MAX_BLOCK_LENGTH 32
+#define MAX_EVENTS 16
+#define KEY_QUEUE_SIZE 16
+#define DIRTY_WORDS ((SCREEN_HEIGHT + 31) / 32)
+
+typedef enum {
+    VM_TEXT = 0,
+    VM_BITMAP,
+} VideoMode;
+
+typedef enum {
+    INT_KEYBOARD = 0,
+    INT_VIDEOMODE,
+    INT_SETCURPOS,
+    INT_GETCURPOS,
+    INT_WRITECHAR,
+    INT_GETPIXEL,
+    INT_SETPIXEL,
+    INT_WRITESTR,
+    INT_WRITENUM,
+    INT_SETTIMER,
+    INT_GETTICKS,
+    INT_SETVECTORS,
+    INT_SETMASK,
+    INT_KEYSTATUS,
+    INT_SETATTR,
+    INT_SETBLINK,
+} Interrupt;
+
+// Hardware interrupt lines. IRQ n is dispatched through the 32-bit handler
+// address at vectors + 4 * n.
+typedef enum {
+    IRQ_TIMER = 0,
+    IRQ_VBLANK,
+    IRQ_KEYBOARD,
+} Irq;
+
+// A text attribute holds the foreground palette index in its low nibble and
+// the background one above it. With blinking on, bit 7 makes the character
+// blink instead of selecting a bright background. 0, which would hide the
+// character, means white on black.
+#define ATTR_BLINK 0x80
+#define DEFAULT_ATTRIBUTE 0x0F
+
+// Status word pushed on interrupt entry and restored by RTI.
+#define STATUS_ZERO 1
+#define STATUS_CARRY 2
+#define STATUS_OVERFLOW 4
+#define STATUS_NEGATIVE 8
+#define STATUS_INTERRUPTS 16
+
+// Device events, timestamped in guest cycles.
+typedef enum {
+    EVENT_VBLANK = 0,
+    EVENT_TIMER,
+    EVENT_KEY,
+} EventType;
+
+typedef struct {
+    uint64_t time;
+    EventType type;
+} Event;
+
+typedef struct {
+    uint64_t time;
+    int key;
+} TimedKey;
+
+// Flags are evaluated lazily from the operands of the last flag-setting
+// instruction. SUB sets them exactly like CMP on the same operands, plus
+// signed overflow. A positive, non-zero logic result clears every flag.
+// After RTI they come straight from the restored status word.
+typedef enum {
+    FLAGS_LOGIC = 0,
+    FLAGS_CMP,
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_STATUS,
+} FlagOp;
+
+typedef struct {
+    uint32_t address;
+    uint32_t imm;
+    uint32_t target;
+    uint8_t opcode;
+    uint8_t r1;
+    uint8_t r2;
+    uint8_t length;
+    uint8_t taken;
+    // Guest instructions this stands for, which is 2 once fused.
+    uint8_t instructions;
+    int cycles;
+} Instruction;
+
+// A translated basic block: the predecoded instructions found by following
+// straight-line code from address, tagged with the guest range they cover.
+typedef struct {
+    uint32_t address;
+    uint32_t end;
+    int count;
+    Instruction code[MAX_BLOCK_LENGTH];
+} Block;
+
+// All the state of one machine. Any number of them can run in a process;
+// a machine must only be run by one thread at a time.
+typedef struct PC32 {
+    uint8_t *memory;
+    uint32_t memorySize;
+    uint32_t reg[16];
+    uint32_t pc;
+    uint32_t sp;
+
+    FlagOp flagOp;
+    uint32_t flagA;
+    uint32_t flagB;
+
+    bool running;
+    float speed;
+    int cyclesPerFrame;
+    uint64_t cycleCount;
+    uint64_t instructionCount;
+
+    VideoMode videoMode;
+    Interrupt interrupt;
+
+    // Set by INT, HLT or the host to make the interpreter return at the end
+    // of the current block.
+    bool pending;
+
+    // Pending device events as a binary min-heap on time. run() services
+    // them between blocks and never runs a block past the next one.
+    Event events[MAX_EVENTS];
+    int eventCount;
+
+    // Set by HLT while the timer or an interrupt could wake the CPU, which
+    // sleeps until one does.
+    bool halted;
+    uint32_t timerPeriod;
+    uint32_t ticks;
+
+    uint32_t vectors;
+    uint32_t irqMask;
+    uint32_t irqPending;
+    bool interruptsEnabled;
+
+    // Keyboard controller. The host queues keys with pressKey() and the
+    // guest takes them in order with INT 0.
+    int keyQueue[KEY_QUEUE_SIZE];
+    uint32_t keyHead;
+    uint32_t keyTail;
+
+    // Keys the host has scheduled with scheduleKey(), pressed in order by
+    // EVENT_KEY once their time comes.
+    TimedKey timedKeys[KEY_QUEUE_SIZE];
+    uint32_t timedHead;
+    uint32_t timedTail;
+
+    int cursorX;
+    int cursorY;
+    // Attribute the BIOS writes text with.
+    uint8_t textAttribute;
+    bool blink;
+
+    // One bit per SCREEN_WIDTH bytes of VRAM, set by any store to them and
+    // cleared by the host once it has shown them. That is a scanline in
+    // bitmap mode and eight rows of text in text mode.
+    uint32_t dirtyLines[DIRTY_WORDS];
+
+    // Binary loaded at address 0 by reset().
+    const char *program;
+
+    uint32_t random;
+
+    Block *blockCache;
+    Block *activeBlock;
+    // Cycles and instructions the interpreter ran before entering the active
+    // block, or -1 outside it, so a fault can charge the pass it cuts short.
+    int passCycles;
+    int passInstructions;
+    Block single;
+    uint8_t *codeMap;
+    bool blockInvalidated;
+
+    sigjmp_buf faultJump;
+    uint32_t faultAddress;
+    bool faulted;
+} PC32;
+
+PC32 *createMachine(uint32_t memorySize);
+void destroyMachine(PC32 *vm);
+
+void reset(PC32 *vm);
+void setSpeed(PC32 *vm, float speed);
+int step(PC32 *vm);
+int run(PC32 *vm, int cycles);
+void handleInterrupts(PC32 *vm);
+
+void scheduleEvent(PC32 *vm, EventType type, uint64_t time);
+void cancelEvent(PC32 *vm, EventType type);
+void raiseIrq(PC32 *vm, Irq irq);
+bool pressKey(PC32 *vm, int key);
+bool scheduleKey(PC32 *vm, uint64_t time, int key);
+
+uint8_t readByte(PC32 *vm, uint32_t address);
+uint16_t readWord(PC32 *vm, uint32_t address);
+uint32_t readLong(PC32 *vm, uint32_t address);
+void writeByte(PC32 *vm, uint32_t address, uint8_t value);
+void writeWord(PC32 *vm, uint32_t address, uint16_t value);
+void writeLong(PC32 *vm, uint32_t address, uint32_t value);
+
+static inline bool zeroFlag(PC32 *vm) {
+    switch (vm->flagOp) {
+    case FLAGS_STATUS:
+        return vm->flagA & STATUS_ZERO;
+    case FLAGS_CMP:
+    case FLAGS_SUB:
+        return vm->flagA == vm->flagB;
+    case FLAGS_ADD:
+        return vm->flagA + vm->flagB == 0;
+    default:
+        return vm->flagA == 0;
+    }
+}
+
+static inline bool carryFlag(PC32 *vm) {
+    switch (vm->flagOp) {
+    case FLAGS_STATUS:
+        return vm->flagA & STATUS_CARRY;
+    case FLAGS_CMP:
+    case FLAGS_SUB:
+        return vm->flagA > vm->flagB;
+    case FLAGS_ADD:
+        return vm->flagA + vm->flagB < vm->flagA;
+    default:
+        return false;
+    }
+}
+
+static inline bool overflowFlag(PC32 *vm) {
+    switch (vm->flagOp) {
+    case FLAGS_STATUS:
+        return vm->flagA & STATUS_OVERFLOW;
+    case FLAGS_ADD:
+        return (~(vm->flagA ^ vm->flagB) & (vm->flagA ^ (vm->flagA + vm->flagB))) >> 31;
+    case FLAGS_SUB:
+        return ((vm->flagA ^ vm->flagB) & (vm->flagA ^ (vm->flagA - vm->flagB))) >> 31;
+    default:
+        return false;
+    }
+}
+
+static inline bool negativeFlag(PC32 *vm) {
+    switch (vm->flagOp) {
+    case FLAGS_STATUS:
+        return vm->flagA & STATUS_NEGATIVE;
+    case FLAGS_CMP:
+    case FLAGS_SUB:
+        return vm->flagA < vm->flagB;
+    case FLAGS_ADD:
+        return (vm->flagA + vm->flagB) >> 31;
+    default:
+        return vm->flagA >> 31;
+    }
+}
+
+#endif
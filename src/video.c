@@ -0,0 +1,166 @@
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+
+#include "pc32.h"
+#include "video.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static void expandScalar(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = palette[in[i]];
+    }
+}
+
+#ifdef X86_KERNELS
+// SSE2 has no gather, so the lookups stay scalar, but the indices are read
+// eight at a time and the pixels written four at a time.
+__attribute__((target("sse2")))
+static void expandSse2(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count) {
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint64_t indices;
+        memcpy(&indices, in + i, sizeof(indices));
+
+        __m128i low = _mm_setr_epi32(palette[indices & 0xFF], palette[(indices >> 8) & 0xFF],
+            palette[(indices >> 16) & 0xFF], palette[(indices >> 24) & 0xFF]);
+        __m128i high = _mm_setr_epi32(palette[(indices >> 32) & 0xFF], palette[(indices >> 40) & 0xFF],
+            palette[(indices >> 48) & 0xFF], palette[indices >> 56]);
+
+        _mm_storeu_si128((__m128i *)(out + i), low);
+        _mm_storeu_si128((__m128i *)(out + i + 4), high);
+    }
+
+    expandScalar(out + i, in + i, palette, count - i);
+}
+
+// Widens eight indices to 32 bits and looks them all up with one gather.
+__attribute__((target("avx2")))
+static void expandAvx2(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count) {
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i low = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(in + i)));
+        __m256i high = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(in + i + 8)));
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_i32gather_epi32((const int *)palette, low, 4));
+        _mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_i32gather_epi32((const int *)palette, high, 4));
+    }
+
+    expandScalar(out + i, in + i, palette, count - i);
+}
+#endif
+
+int paletteKernels(PaletteKernel *kernels) {
+    int count = 0;
+
+    kernels[count++] = (PaletteKernel){ "scalar", expandScalar };
+
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[count++] = (PaletteKernel){ "sse2", expandSse2 };
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count++] = (PaletteKernel){ "avx2", expandAvx2 };
+    }
+#endif
+
+    return count;
+}
+
+void expandPalette(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count) {
+    static PaletteExpander best = NULL;
+
+    if (!best) {
+        PaletteKernel kernels[MAX_PALETTE_KERNELS];
+
+        best = kernels[paletteKernels(kernels) - 1].expand;
+    }
+
+    best(out, in, palette, count);
+}
+
+#define NO_CELL UINT32_MAX
+
+void setTextColors(TextRenderer *text, const uint32_t *colors) {
+    memcpy(text->colors, colors, sizeof(text->colors));
+
+    for (int i = 0; i < CELL_CACHE_SIZE; i++) {
+        text->keys[i] = NO_CELL;
+    }
+}
+
+// Blends each pixel from the background to the foreground color by its
+// glyph coverage.
+static void composeCell(TextRenderer *text, uint32_t *cell, int c, int foreground, int background) {
+    uint32_t fg = text->colors[foreground];
+    uint32_t bg = text->colors[background];
+
+    for (int i = 0; i < GLYPH_SIZE * GLYPH_SIZE; i++) {
+        uint32_t coverage = text->glyphs[c][i];
+        uint32_t pixel = 0;
+
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t from = (bg >> shift) & 0xFF;
+            uint32_t to = (fg >> shift) & 0xFF;
+
+            pixel |= ((from * (255 - coverage) + to * coverage + 127) / 255) << shift;
+        }
+
+        cell[i] = pixel;
+    }
+}
+
+// Returns the image of the cell with key, a character in its low byte and
+// the foreground and background colors above, composing it on a miss.
+static const uint32_t *findCell(TextRenderer *text, uint16_t key) {
+    uint32_t slot = (key * 0x9E3779B1u) >> 20;
+
+    if (text->keys[slot] != key) {
+        composeCell(text, text->cells[slot], key & 0xFF, (key >> 8) & 0xF, key >> 12);
+        text->keys[slot] = key;
+        text->misses++;
+    }
+
+    return text->cells[slot];
+}
+
+int renderTextRow(TextRenderer *text, uint32_t *pixels, int stride, const uint8_t *chars,
+    const uint8_t *attributes, uint16_t *shadow, int columns, bool blink, bool blinkOff, bool force) {
+    int drawn = 0;
+
+    for (int x = 0; x < columns; x++) {
+        int attribute = attributes[x] ? attributes[x] : DEFAULT_ATTRIBUTE;
+        int foreground = attribute & 0xF;
+        int background = blink ? (attribute >> 4) & 0x7 : attribute >> 4;
+
+        if (blink && (attribute & ATTR_BLINK) && blinkOff) {
+            foreground = background;
+        }
+
+        uint16_t key = chars[x] | foreground << 8 | background << 12;
+
+        if (!force && key == shadow[x]) {
+            continue;
+        }
+
+        const uint32_t *cell = findCell(text, key);
+
+        for (int y = 0; y < GLYPH_SIZE; y++) {
+            memcpy(pixels + y * stride + x * GLYPH_SIZE, cell + y * GLYPH_SIZE, GLYPH_SIZE * sizeof(uint32_t));
+        }
+
+        shadow[x] = key;
+        drawn++;
+    }
+
+    return drawn;
+}
@@ -0,0 +1,51 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_PALETTE_KERNELS 3
+#define GLYPH_SIZE 8
+#define CELL_CACHE_SIZE 4096
+
+// Turns count 8-bit palette indices into 32-bit pixels.
+typedef void (*PaletteExpander)(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count);
+
+typedef struct {
+    const char *name;
+    PaletteExpander expand;
+} PaletteKernel;
+
+// Fills kernels with the palette expansion kernels the host CPU can run,
+// the portable scalar one first and the fastest last, and returns how many
+// there are.
+int paletteKernels(PaletteKernel *kernels);
+
+// Expands with the fastest kernel the host CPU can run.
+void expandPalette(uint32_t *out, const uint8_t *in, const uint32_t *palette, int count);
+
+// Coverage of each pixel of a GLYPH_SIZE square for every character code.
+typedef uint8_t GlyphAtlas[256][GLYPH_SIZE * GLYPH_SIZE];
+
+// Text cells are drawn from a direct-mapped cache of cell images, keyed by
+// character and resolved colors and composed from the atlas on a miss.
+typedef struct {
+    GlyphAtlas glyphs;
+    uint32_t colors[16];
+    uint32_t keys[CELL_CACHE_SIZE];
+    uint32_t cells[CELL_CACHE_SIZE][GLYPH_SIZE * GLYPH_SIZE];
+    int misses;
+} TextRenderer;
+
+// Sets the 16 text colors and empties the cache.
+void setTextColors(TextRenderer *text, const uint32_t *colors);
+
+// Draws the cells of one text row whose character or colors differ from
+// shadow, or all of them with force, into pixels, which is stride pixels
+// wide, and records them in shadow. With blink set, bit 7 of an attribute
+// blinks the cell and blinkOff hides its character. Returns the number of
+// cells drawn.
+int renderTextRow(TextRenderer *text, uint32_t *pixels, int stride, const uint8_t *chars,
+    const uint8_t *attributes, uint16_t *shadow, int columns, bool blink, bool blinkOff, bool force);
+
+#endif
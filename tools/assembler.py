@@ -110,6 +110,8 @@ def parselabels():
                 bytes += 2
             elif opcode == "RET":
                 bytes += 1
+            elif opcode == "RTI":
+                bytes += 1
             elif opcode == "STB":
                 bytes += 3
             elif opcode == "STA":
@@ -336,6 +338,8 @@ def main():
                 write_byte([0x25, r1])
             elif opcode == "RET":
                 write_byte([0x26])
+            elif opcode == "RTI":
+                write_byte([0x31])
             elif opcode == "STB":
                 r1 = int(token[1].strip())
                 r2 = int(token[2].strip())